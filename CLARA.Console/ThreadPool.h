@@ -0,0 +1,75 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for running a batch of independent tasks
+// Each worker takes tasks from the back of its own queue and steals from the front of the others' when it runs dry
+class ThreadPool {
+	struct Queue {
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	size_t m_next = 0;
+
+	bool Pop(size_t worker, std::function<void()>& task) {
+		auto& own = *m_queues[worker];
+		{
+			std::lock_guard<std::mutex> guard(own.lock);
+			if (!own.tasks.empty()) {
+				task = std::move(own.tasks.back());
+				own.tasks.pop_back();
+				return true;
+			}
+		}
+
+		for (size_t i = 1; i < m_queues.size(); ++i) {
+			auto& victim = *m_queues[(worker + i) % m_queues.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.tasks.empty()) {
+				task = std::move(victim.tasks.front());
+				victim.tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void Work(size_t worker) {
+		std::function<void()> task;
+		while (Pop(worker, task))
+			task();
+	}
+
+public:
+	ThreadPool(size_t numThreads = 0) {
+		if (!numThreads) numThreads = std::thread::hardware_concurrency();
+		if (!numThreads) numThreads = 1;
+		for (size_t i = 0; i < numThreads; ++i)
+			m_queues.emplace_back(new Queue);
+	}
+
+	inline size_t GetNumThreads() const { return m_queues.size(); }
+
+	// Queues a task - tasks are dealt out to the workers in turn
+	void Add(std::function<void()> task) {
+		auto& queue = *m_queues[m_next++ % m_queues.size()];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.tasks.emplace_back(std::move(task));
+	}
+
+	// Runs every queued task across the workers, returning once they have all completed
+	void Run() {
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < m_queues.size(); ++i)
+			threads.emplace_back(&ThreadPool::Work, this, i);
+		Work(0);
+		for (auto& thread : threads)
+			thread.join();
+	}
+};
@@ -1,45 +1,313 @@
 #include "stdafx.h"
 #include <CLARA/Compiler.h>
+#include <CLARA.VM/JIT.h>
+#include <CLARA.VM/Profile.h>
+#include <CLARA.VM/VM.h>
+#include "ThreadPool.h"
 
-std::vector<std::string> inputPaths;
+namespace fs = std::filesystem;
+
+struct Job {
+	std::string inputPath;
+	std::string outputPath;
+	std::vector<std::string> errors;
+	std::vector<std::string> messages;
+	CLARA::CLARA_ERROR result = CLARA::CLARA_ERROR_NONE;
+};
+
+struct Input {
+	std::string path;
+	std::string relative;		// where it goes under an output directory - its path within the directory it was found in
+};
+
+std::vector<Input> inputs;
 std::string outputPath;
+std::string cachePath;
+bool streaming = false;
+bool peephole = false;
+bool fold = false;
+bool longBranches = false;
+bool map = false;
+bool run = false;
+bool predecode = false;
+bool jit = false;
+bool verify = true;
+std::string profileFormat;
+size_t benchRuns = 0;
+
+void Syntax(const char* name) {
+	std::cout << "syntax: " << name << " [-o <output>] [-j <threads>] [-stream] [-peephole] [-fold] [-long-branches] [-map] [-cache <dir>] [-run] [-predecode] [-jit] [-no-verify] [-profile <csv|json>] [-bench <n>] <input...>" << std::endl;
+	std::cout << "  inputs may be .clasm files, directories to search for them, or @response files listing one input per line" << std::endl;
+	std::cout << "  the output is a file for a single input, otherwise a directory (default: next to each input)" << std::endl;
+	std::cout << "  -map writes where each global was laid out to a .map file next to the output" << std::endl;
+	std::cout << "  -cache reuses the output of unchanged inputs from an earlier build" << std::endl;
+	std::cout << "  -run executes each compiled script and reports how it finished" << std::endl;
+	std::cout << "  -predecode runs scripts from instructions decoded as they're loaded, rather than from the bytecode" << std::endl;
+	std::cout << "  -jit compiles hot code to native code where supported" << std::endl;
+	std::cout << "  -no-verify keeps the runtime checks for scripts the verifier would let run without them" << std::endl;
+	std::cout << "  -profile runs each compiled script and reports the instructions it ran, in a VM built with CLARA_VM_PROFILE" << std::endl;
+	std::cout << "  -bench runs each compiled script n times each way and compares the timings" << std::endl;
+}
+
+bool AddInput(const std::string& path) {
+	if (!path.empty() && path[0] == '@') {
+		std::ifstream file(path.substr(1));
+		if (!file.is_open()) {
+			std::cerr << "failed to open response file '" << path.substr(1) << "'" << std::endl;
+			return false;
+		}
+
+		bool ok = true;
+		for (std::string line; std::getline(file, line); ) {
+			while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+				line.pop_back();
+			if (!line.empty() && line[0] != '#')
+				ok &= AddInput(line);
+		}
+		return ok;
+	}
+
+	std::error_code ec;
+	if (fs::is_directory(path, ec)) {
+		for (auto& entry : fs::recursive_directory_iterator(path, ec)) {
+			if (entry.is_regular_file(ec) && entry.path().extension() == ".clasm")
+				inputs.push_back({entry.path().string(), entry.path().lexically_relative(path).string()});
+		}
+		return true;
+	}
+
+	inputs.push_back({path, fs::path(path).filename().string()});
+	return true;
+}
+
+// Runs a compiled script - returns false if it didn't run to completion
+bool RunScript(const Job& job) {
+	CLARA::IMAGE_ERROR error;
+	auto image = CLARA::Image::Open(job.outputPath.c_str(), &error);
+	if (!image) {
+		std::cerr << job.outputPath << ": " << CLARA::GetImageErrorName(error) << std::endl;
+		return false;
+	}
+
+	CLARA::VM vm;
+	vm.SetPredecode(predecode);
+	vm.SetVerify(verify);
+	if (jit) vm.SetJitThreshold();
+	vm.Load(image);
+
+	auto status = vm.Run();
+	while (status == CLARA::VM_BREAK)
+		status = vm.Run();
+
+	std::cout << job.outputPath << ": " << CLARA::GetStatusName(status);
+	if (status == CLARA::VM_THROWN)
+		std::cout << " " << vm.GetThrowCode();
+	else if (status != CLARA::VM_DONE)
+		std::cout << " at offset " << vm.GetErrorOffset();
+	else if (vm.GetStackDepth()) {
+		auto& top = vm.Top();
+		std::cout << ", result ";
+		if (top.IsFloat()) std::cout << top.fValue;
+		else if (top.IsString()) std::cout << '"' << vm.GetString(top) << '"';
+		else std::cout << top.nValue;
+	}
+	// say why a script needed the runtime checks
+	auto& verification = image->GetVerification();
+	if (verify && verification.result != CLARA::VERIFY_OK)
+		std::cout << " (unverified: " << CLARA::GetVerifyResultName(verification.result) << " at offset " << verification.offset << ")";
+	std::cout << std::endl;
+
+	if (!profileFormat.empty()) {
+		if (auto profile = vm.GetProfile())
+			profile->Report(profileFormat == "json" ? CLARA::PROFILE_JSON : CLARA::PROFILE_CSV);
+		else
+			std::cerr << job.outputPath << ": no profile, the VM wasn't built with CLARA_VM_PROFILE" << std::endl;
+	}
+	return status == CLARA::VM_DONE;
+}
+
+// Times 'benchRuns' runs of a compiled script from its bytecode, predecoded, and with the JIT if there is one
+bool BenchScript(const Job& job) {
+	auto image = CLARA::Image::Open(job.outputPath.c_str());
+	if (!image) return false;
+
+	enum { BYTECODE, PREDECODED, JIT, NUM_MODES };
+	double seconds[NUM_MODES];
+	CLARA::VM_STATUS status = CLARA::VM_DONE;
+	int numModes = CLARA::JIT::IsSupported() ? NUM_MODES : JIT;
+	for (int mode = 0; mode < numModes; ++mode) {
+		CLARA::VM vm;
+		vm.SetPredecode(mode == PREDECODED);
+		vm.SetVerify(verify);
+		if (mode == JIT) vm.SetJitThreshold();
+		vm.Load(image);
+
+		// the first run is left out, so decoding the image isn't counted (code only gets hot within it if it loops)
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i <= benchRuns; ++i) {
+			if (i == 1) start = std::chrono::steady_clock::now();
+			vm.Reset();
+			do status = vm.Run();
+			while (status == CLARA::VM_BREAK);
+		}
+		seconds[mode] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	std::cout << job.outputPath << ": " << benchRuns << " run(s), bytecode " << seconds[BYTECODE] * 1000 << "ms, predecoded "
+		<< seconds[PREDECODED] * 1000 << "ms (" << seconds[BYTECODE] / seconds[PREDECODED] << "x)";
+	if (numModes > JIT)
+		std::cout << ", jit " << seconds[JIT] * 1000 << "ms (" << seconds[BYTECODE] / seconds[JIT] << "x)";
+	std::cout << std::endl;
+	return status == CLARA::VM_DONE;
+}
+
+std::string GetOutputPath(const Input& input, bool toDirectory) {
+	fs::path path(input.path);
+	if (!outputPath.empty()) {
+		if (!toDirectory) return outputPath;
+		path = fs::path(outputPath) / input.relative;
+	}
+	path.replace_extension(".clo");
+	return path.string();
+}
+
+// Reads a count given on the command line - returns false if it isn't a whole number
+bool ParseCount(std::string_view text, size_t& count) {
+	auto end = text.data() + text.size();
+	auto result = std::from_chars(text.data(), end, count);
+	return !text.empty() && result.ec == std::errc() && result.ptr == end;
+}
 
 int main(int argc, char* argv[]) {
-	/*if (argc < 2) {
-		std::cout << "syntax: " << argv[0] << " <input...> <output>";
+	size_t numThreads = 0;
+	std::vector<std::string> args;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "-o" && i + 1 < argc) outputPath = argv[++i];
+		else if (arg == "-j" && i + 1 < argc) {
+			if (!ParseCount(argv[++i], numThreads)) {
+				Syntax(argv[0]);
+				return 1;
+			}
+		}
+		else if (arg == "-stream") streaming = true;
+		else if (arg == "-peephole") peephole = true;
+		else if (arg == "-fold") fold = true;
+		else if (arg == "-long-branches") longBranches = true;
+		else if (arg == "-map") map = true;
+		else if (arg == "-cache" && i + 1 < argc) cachePath = argv[++i];
+		else if (arg == "-run") run = true;
+		else if (arg == "-predecode") predecode = true;
+		else if (arg == "-jit") jit = true;
+		else if (arg == "-no-verify") verify = false;
+		else if (arg == "-profile" && i + 1 < argc) {
+			profileFormat = argv[++i];
+			run = true;
+		}
+		else if (arg == "-bench" && i + 1 < argc) {
+			if (!ParseCount(argv[++i], benchRuns)) {
+				Syntax(argv[0]);
+				return 1;
+			}
+		}
+		else if (arg == "-h" || arg == "-help" || arg == "--help") {
+			Syntax(argv[0]);
+			return 0;
+		}
+		else args.push_back(arg);
+	}
+
+	// "<input_path> <output_path>" is still accepted
+	if (args.size() == 2 && outputPath.empty() && fs::path(args[1]).extension() == ".clo") {
+		outputPath = args[1];
+		args.pop_back();
+	}
+
+	bool ok = true;
+	for (auto& arg : args)
+		ok &= AddInput(arg);
+	if (!ok) return 1;
+	if (inputs.empty()) {
+		Syntax(argv[0]);
 		return 1;
 	}
-	for (int i = 1; i < argc; ++i) {
-		if (i == (argc - 1)) outputPath = argv[i];
-		else inputPaths.push_back(argv[i]);
-	}*/
-
-	const char* pathin = argv[1], *pathout;
-	std::string spathout;
-	if (argc < 3) {
-		spathout = pathin;
-		auto pos = spathout.find_last_of('.');
-		if (pos == spathout.npos) {
-			std::cout << "syntax: " << argv[0] << " <input_path> <output_path>";
+
+	bool toDirectory = inputs.size() > 1 || fs::is_directory(outputPath);
+
+	// two inputs with the same output would overwrite each other, concurrently with -j
+	std::vector<Job> jobs(inputs.size());
+	std::unordered_map<std::string, const Job*> outputs;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		jobs[i].inputPath = inputs[i].path;
+		jobs[i].outputPath = GetOutputPath(inputs[i], toDirectory);
+		auto key = fs::absolute(jobs[i].outputPath).lexically_normal().string();
+		auto it = outputs.emplace(key, &jobs[i]).first;
+		if (it->second != &jobs[i]) {
+			std::cerr << "'" << it->second->inputPath << "' and '" << jobs[i].inputPath << "' would both be compiled to '"
+				<< jobs[i].outputPath << "'" << std::endl;
 			return 1;
 		}
+	}
+	if (toDirectory && !outputPath.empty()) {
+		std::error_code ec;
+		for (auto& job : jobs)
+			fs::create_directories(fs::path(job.outputPath).parent_path(), ec);
+	}
 
-		spathout = spathout.substr(0, pos);
-		spathout += ".clo";
+	// profiles go through the default context's output handler, the jobs each have their own
+	if (!profileFormat.empty()) {
+		CLARA::SetOutputHandler([](const char* msg) {
+			std::cout << msg;
+			return true;
+		});
+	}
 
-		pathout = spathout.c_str();
+	ThreadPool pool(std::min(numThreads ? numThreads : std::thread::hardware_concurrency(), jobs.size()));
+	for (auto& job : jobs) {
+		pool.Add([&job]() {
+			// each job gets its own context, so its diagnostics go straight to it
+			auto context = CLARA::CreateContext();
+			CLARA::ContextSetErrorHandler(context, [](CLARA::CLARA_ERROR, const char* error, void* userdata) {
+				static_cast<Job*>(userdata)->errors.emplace_back(error);
+				return true;
+			}, &job);
+			CLARA::ContextSetOutputHandler(context, [](const char * msg, void* userdata) {
+				static_cast<Job*>(userdata)->messages.emplace_back(msg);
+				return true;
+			}, &job);
+			CLARA::ContextSetOption(context, CLARA::CLARA_OPTION_STREAMING, streaming ? 1 : 0);
+			CLARA::ContextSetOption(context, CLARA::CLARA_OPTION_PEEPHOLE, peephole ? CLARA::CLARA_PEEPHOLE_ALL : 0);
+			CLARA::ContextSetOption(context, CLARA::CLARA_OPTION_FOLD, fold ? 1 : 0);
+			CLARA::ContextSetOption(context, CLARA::CLARA_OPTION_LONG_BRANCHES, longBranches ? 1 : 0);
+			CLARA::ContextSetOption(context, CLARA::CLARA_OPTION_MAP, map ? 1 : 0);
+			CLARA::ContextSetCacheDirectory(context, cachePath.c_str());
+			job.result = CLARA::ContextCompile(context, job.inputPath.c_str(), job.outputPath.c_str());
+			CLARA::DestroyContext(context);
+		});
 	}
-	else pathout = argv[2];
+	pool.Run();
 
-	CLARA::SetErrorHandler([](CLARA::CLARA_ERROR code, const char* error) {
-		std::cerr << error << std::endl;
-		return true;
-	});
-	CLARA::SetOutputHandler([](const char * msg) {
-		std::cout << msg << std::endl;
-		return true;
-	});
-	bool b = CLARA::Compile(pathin, pathout) == CLARA::CLARA_ERROR_NONE;
-	ASSERT(b);
-	return 0;
-}
\ No newline at end of file
+	// report the diagnostics of each file together, in the order they were given
+	size_t numFailed = 0;
+	for (auto& job : jobs) {
+		bool failed = job.result != CLARA::CLARA_ERROR_NONE || !job.errors.empty();
+
+		if (jobs.size() == 1) {
+			for (auto& msg : job.messages)
+				std::cout << msg << std::endl;
+		}
+		for (auto& error : job.errors)
+			std::cerr << job.inputPath << ": " << error << std::endl;
+
+		if (run && !failed)
+			failed = !RunScript(job);
+		if (benchRuns && !failed)
+			failed = !BenchScript(job);
+		if (failed) ++numFailed;
+	}
+
+	if (jobs.size() > 1)
+		std::cout << jobs.size() - numFailed << " of " << jobs.size() << " file(s) compiled using " << pool.GetNumThreads() << " thread(s)" << std::endl;
+	return numFailed ? 1 : 0;
+}
@@ -1,6 +1,14 @@
 #pragma once
 #include <stdio.h>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <assert.h>
 #include <sstream>
@@ -0,0 +1,230 @@
+#include "stdafx.h"
+#include <CLARA/Assembly.h>
+#include "Image.h"
+
+CLARA_NAMESPACE_BEGIN
+
+const uint8_t* GetInstructionSizes() {
+	static const struct Sizes {
+		uint8_t sizes[256];
+
+		Sizes() {
+			for (auto& size : sizes) size = 1;
+			for (size_t i = 0; i < MAX_INSN; ++i) {
+				for (auto param : g_Instructions[i].params)
+					sizes[i] += static_cast<uint8_t>(GetImmSize(*param));
+			}
+		}
+	} table;
+	return table.sizes;
+}
+
+const char* GetImageErrorName(IMAGE_ERROR error) {
+	switch (error) {
+	case IMAGE_OK: return "ok";
+	case IMAGE_ERROR_OPEN: return "failed to open file";
+	case IMAGE_ERROR_HEADER: return "not a compiled script";
+	case IMAGE_ERROR_VERSION: return "built for a newer version";
+	case IMAGE_ERROR_FORMAT: return "unsupported instruction or integer size";
+	case IMAGE_ERROR_SEGMENTS: return "segment sizes don't match the file";
+	case IMAGE_ERROR_STRINGS: return "malformed string table";
+	}
+	return "unknown";
+}
+
+IMAGE_ERROR Image::Validate() {
+	if (m_size < sizeof(FileHeader)) return IMAGE_ERROR_HEADER;
+
+	memcpy(&m_header, m_data, sizeof(FileHeader));
+	if (m_header.Signature != FileHeader().Signature || m_header.Architecture != FileHeader().Architecture)
+		return IMAGE_ERROR_HEADER;
+	if (!m_header.Validate())
+		return IMAGE_ERROR_VERSION;
+	if (m_header.InstructionSize != 1 || m_header.IntegerSize != 4)
+		return IMAGE_ERROR_FORMAT;
+
+	// the segments have to cover the file exactly - sizes are checked in 64 bits so they can't wrap
+	uint64_t globalsSize = static_cast<uint64_t>(m_header.NumGlobals) * 4;
+	uint64_t end = static_cast<uint64_t>(m_header.GlobalsOffset) + globalsSize + m_header.StringSegmentSize;
+	if (m_header.GlobalsOffset < sizeof(FileHeader) || end != m_size)
+		return IMAGE_ERROR_SEGMENTS;
+
+	m_code = {m_data + sizeof(FileHeader), m_header.GlobalsOffset - sizeof(FileHeader)};
+	m_globals = {m_data + m_header.GlobalsOffset, static_cast<size_t>(globalsSize)};
+
+	// the string table has to stay inside the segment, and every text has to end in its NUL - the hashes are
+	// taken on trust, as a wrong one only stops FindString() finding the string
+	const uint8_t* segment = m_globals.end();
+	size_t segmentSize = m_header.StringSegmentSize;
+	if (segmentSize) {
+		uint32_t count;
+		if (segmentSize < sizeof(count)) return IMAGE_ERROR_STRINGS;
+		memcpy(&count, segment, sizeof(count));
+		uint64_t tableSize = sizeof(count) + static_cast<uint64_t>(count) * sizeof(StringEntry);
+		if (tableSize > segmentSize) return IMAGE_ERROR_STRINGS;
+
+		m_strings = {reinterpret_cast<const StringEntry*>(segment + sizeof(count)), count};
+		m_texts = {reinterpret_cast<const char*>(segment + tableSize), segmentSize - static_cast<size_t>(tableSize)};
+		for (auto& entry : m_strings) {
+			uint64_t end = static_cast<uint64_t>(entry.Offset) + entry.Length;
+			if (end >= m_texts.size || m_texts[static_cast<size_t>(end)]) return IMAGE_ERROR_STRINGS;
+		}
+	}
+	return IMAGE_OK;
+}
+
+void Image::BuildStringIndex() const {
+	size_t size = 1;
+	while (size < m_strings.size * 2) size <<= 1;
+	m_stringIndex.assign(size, 0);
+	for (uint32_t i = 0; i < m_strings.size; ++i) {
+		size_t slot = m_strings[i].Hash & (size - 1);
+		while (m_stringIndex[slot]) slot = (slot + 1) & (size - 1);
+		m_stringIndex[slot] = i + 1;
+	}
+}
+
+uint32_t Image::FindString(std::string_view text) const {
+	std::call_once(m_stringIndexOnce, &Image::BuildStringIndex, this);
+	uint32_t hash = HashString(text.data(), text.size());
+	size_t mask = m_stringIndex.size() - 1;
+	for (size_t slot = hash & mask; m_stringIndex[slot]; slot = (slot + 1) & mask) {
+		uint32_t i = m_stringIndex[slot] - 1;
+		auto& entry = m_strings[i];
+		if (entry.Hash == hash && entry.Length == text.size() && !memcmp(m_texts.data + entry.Offset, text.data(), text.size()))
+			return i;
+	}
+	return INVALID_STRING;
+}
+
+void Image::BuildInstructionMap() const {
+	auto sizes = GetInstructionSizes();
+	// the end of the code counts as one too - branching there returns, like running off the end
+	m_starts.assign(m_code.size + 1, false);
+	m_starts[m_code.size] = true;
+	m_truncated = m_code.size;
+
+	for (size_t offset = 0; offset < m_code.size; offset += sizes[m_code[offset]]) {
+		if (offset + sizes[m_code[offset]] > m_code.size) {
+			m_truncated = offset;
+			break;
+		}
+		m_starts[offset] = true;
+	}
+}
+
+const DecodedCode& Image::GetDecodedCode(const void* const* handlers) const {
+	std::lock_guard<std::mutex> lock(m_decodeLock);
+	for (auto& decoding : m_decodings) {
+		if (decoding->handlers == handlers)
+			return decoding->code;
+	}
+
+	m_decodings.push_back(std::make_unique<Decoding>());
+	auto& decoding = *m_decodings.back();
+	decoding.handlers = handlers;
+	Decode(decoding.code, handlers);
+	return decoding.code;
+}
+
+void Image::Decode(DecodedCode& decoded, const void* const* handlers) const {
+	auto sizes = GetInstructionSizes();
+	auto& cells = decoded.cells;
+	auto& offsets = decoded.offsets;
+	auto code = m_code.data;
+	size_t size = m_code.size;
+
+	auto add = [&](uintptr_t index, uint32_t offset, uint32_t operand) {
+		Cell cell;
+		cell.index = index;
+		cell.dwOperand = operand;
+		cells.push_back(cell);
+		offsets.push_back(offset);
+	};
+
+	size_t offset = 0;
+	while (offset < size) {
+		uint8_t op = code[offset];
+		size_t next = offset + sizes[op];
+		if (op >= MAX_INSN || next > size) {
+			add(CELL_INVALID, static_cast<uint32_t>(offset), 0);
+			if (next > size) break;
+			offset = next;
+			continue;
+		}
+
+		// operands are unsigned apart from the immediates which are pushed or thrown
+		uint32_t operand = 0;
+		const uint8_t* p = code + offset + 1;
+		switch (next - offset - 1) {
+		case 1: operand = p[0]; break;
+		case 2: operand = p[0] | (p[1] << 8); break;
+		case 4: operand = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24); break;
+		}
+		if (op == INSN_THROW || op == INSN_PUSHB) operand = static_cast<uint32_t>(static_cast<int8_t>(operand));
+		else if (op == INSN_PUSHW) operand = static_cast<uint32_t>(static_cast<int16_t>(operand));
+		// switches keep their default and table entries their target, the rest is read from the code
+		else if (op == INSN_SWITCH || op == INSN_RSWITCH) operand = p[2] | (p[3] << 8) | (p[4] << 16) | (static_cast<uint32_t>(p[5]) << 24);
+		else if (op == INSN_CASE) operand = p[4] | (p[5] << 8) | (p[6] << 16) | (static_cast<uint32_t>(p[7]) << 24);
+
+		add(op, static_cast<uint32_t>(offset), operand);
+		offset = next;
+	}
+	add(CELL_END, static_cast<uint32_t>(size), 0);
+
+	for (size_t i = 0; i < cells.size(); ++i) {
+		auto& cell = cells[i];
+		switch (cell.index) {
+		case INSN_JT: case INSN_JNT: case INSN_JMPA: case INSN_CALLA: case INSN_CASE:
+			cell.dwOperand = decoded.Find(cell.dwOperand);
+			break;
+		case INSN_SWITCH: case INSN_RSWITCH:
+		{
+			// the whole table has to be there for the switch to index the cells after it
+			size_t count = code[offsets[i] + 1] | (code[offsets[i] + 2] << 8);
+			bool valid = i + count < cells.size() - 1;
+			for (size_t j = i + 1; valid && j <= i + count; ++j)
+				valid = cells[j].index == INSN_CASE;
+			if (valid) cell.dwOperand = decoded.Find(cell.dwOperand);
+			else cell.index = CELL_INVALID;
+			break;
+		}
+		// short branches are relative to the next instruction
+		case INSN_JTB: case INSN_JNTB: case INSN_JMPB:
+			cell.dwOperand = decoded.Find(offsets[i + 1] + static_cast<uint32_t>(static_cast<int8_t>(cell.dwOperand)));
+			break;
+		case INSN_JTW: case INSN_JNTW: case INSN_JMPW:
+			cell.dwOperand = decoded.Find(offsets[i + 1] + static_cast<uint32_t>(static_cast<int16_t>(cell.dwOperand)));
+			break;
+		}
+		if (handlers) cell.handler = handlers[cell.index];
+	}
+}
+
+std::shared_ptr<const Image> Image::Open(const char* path, IMAGE_ERROR* error) {
+	auto image = std::make_shared<Image>();
+	IMAGE_ERROR err = IMAGE_ERROR_OPEN;
+
+	if (image->m_file.Open(path)) {
+		image->m_data = reinterpret_cast<const uint8_t*>(image->m_file.Data());
+		image->m_size = image->m_file.Size();
+		err = image->Validate();
+	}
+
+	if (error) *error = err;
+	return err == IMAGE_OK ? image : nullptr;
+}
+
+std::shared_ptr<const Image> Image::Create(const void* data, size_t size, IMAGE_ERROR* error) {
+	auto image = std::make_shared<Image>();
+	auto bytes = static_cast<const uint8_t*>(data);
+	image->m_buffer.assign(bytes, bytes + size);
+	image->m_data = image->m_buffer.data();
+	image->m_size = size;
+
+	auto err = image->Validate();
+	if (error) *error = err;
+	return err == IMAGE_OK ? image : nullptr;
+}
+
+CLARA_NAMESPACE_END
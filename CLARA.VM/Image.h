@@ -0,0 +1,178 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include <CLARA/CLARA.h>
+#include <CLARA/File.h>
+#include <CLARA/MappedFile.h>
+
+CLARA_NAMESPACE_BEGIN
+
+enum IMAGE_ERROR {
+	IMAGE_OK,
+	IMAGE_ERROR_OPEN,			// the file couldn't be opened or mapped
+	IMAGE_ERROR_HEADER,			// too small for a header, or the signature doesn't match
+	IMAGE_ERROR_VERSION,		// built for a newer version of the format
+	IMAGE_ERROR_FORMAT,			// instruction or integer size the VM can't run
+	IMAGE_ERROR_SEGMENTS,		// the segment sizes don't add up to the file size
+	IMAGE_ERROR_STRINGS,		// a string table entry outside the segment, or a text without its NUL
+};
+
+enum VERIFY_RESULT {
+	VERIFY_OK,
+	VERIFY_INVALID_INSTRUCTION,	// unknown opcode, or an instruction cut short by the end of the code
+	VERIFY_BAD_JUMP,			// a branch target outside the code or in the middle of an instruction
+	VERIFY_BAD_SWITCH,			// a switch table which runs past the end of the code or has something else in it
+	VERIFY_BAD_GLOBAL,			// a global index which isn't below the header's NumGlobals
+	VERIFY_UNBALANCED_STACK,	// an instruction reached with different stack depths
+	VERIFY_STACK_UNDERFLOW,		// an instruction which pops more values than there are
+	VERIFY_UNBOUNDED,			// recursion or a computed jmp/call, so the depth can't be worked out
+};
+
+// What the verifier made of an image's code
+struct Verification {
+	VERIFY_RESULT result = VERIFY_OK;
+	uint32_t offset = 0;				// offset of the instruction it failed at
+	uint32_t stackSize = 0;				// values the stack needs room for if it passed
+};
+
+// View of a contiguous run of elements owned by something else
+template<typename T>
+struct Span {
+	const T* data = nullptr;
+	size_t size = 0;
+
+	inline const T* begin() const { return data; }
+	inline const T* end() const { return data + size; }
+	inline const T& operator[](size_t i) const { return data[i]; }
+	inline bool empty() const { return !size; }
+};
+
+// An instruction decoded ahead of time - what to run and its operand, already widened to 32 bits
+// Branch operands are cell indexes rather than code offsets
+struct alignas(2 * sizeof(void*)) Cell {
+	union {
+		const void* handler;		// address of the VM's handler, where it dispatches by address
+		uintptr_t index;			// the opcode or one of CELL_END/CELL_INVALID otherwise
+	};
+	union {
+		int32_t nOperand;
+		uint32_t dwOperand;
+	};
+};
+enum {
+	CELL_END = MAX_INSN,		// follows the last instruction
+	CELL_INVALID,				// unknown opcode or an instruction cut short by the end of the code
+	NUM_CELL_HANDLERS,
+};
+enum : uint32_t { INVALID_CELL = UINT32_MAX, INVALID_STRING = UINT32_MAX };
+
+struct DecodedCode {
+	std::vector<Cell> cells;			// one per instruction, then the end cell
+	std::vector<uint32_t> offsets;		// code offset of each cell
+
+	// Index of the cell decoded from the instruction at 'offset' (the end cell for the end of the code), or
+	// INVALID_CELL if none starts there
+	uint32_t Find(uint32_t offset) const {
+		auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+		return it != offsets.end() && *it == offset ? static_cast<uint32_t>(it - offsets.begin()) : INVALID_CELL;
+	}
+};
+
+// A validated compiled script, usually mapped straight from its file - the segments are views into it
+// Images are immutable once loaded, so any number of VMs can share one through a shared_ptr
+class Image {
+	MappedFile m_file;
+	std::vector<uint8_t> m_buffer;		// the image when it was copied from memory instead
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+
+	FileHeader m_header;
+	Span<uint8_t> m_code;
+	Span<uint8_t> m_globals;
+	Span<StringEntry> m_strings;		// the string table - entries are packed, so they can be read in place
+	Span<char> m_texts;
+
+	// hash table of the string indexes + 1, from the stored hashes
+	mutable std::once_flag m_stringIndexOnce;
+	mutable std::vector<uint32_t> m_stringIndex;
+
+	// which code offsets start an instruction - worked out on first use so loading doesn't touch the code
+	mutable std::once_flag m_mapOnce;
+	mutable std::vector<bool> m_starts;
+	mutable size_t m_truncated = 0;
+
+	// one decoding per dispatch table, as the checked and unchecked interpreters have their own handlers
+	struct Decoding {
+		const void* const* handlers;
+		DecodedCode code;
+	};
+	mutable std::mutex m_decodeLock;
+	mutable std::vector<std::unique_ptr<Decoding>> m_decodings;
+
+	mutable std::once_flag m_verifyOnce;
+	mutable Verification m_verification;
+
+	IMAGE_ERROR Validate();
+	void BuildInstructionMap() const;
+	void BuildStringIndex() const;
+	void Decode(DecodedCode& decoded, const void* const* handlers) const;
+	void Verify() const;
+
+public:
+	Image() = default;
+	Image(const Image&) = delete;
+	Image& operator=(const Image&) = delete;
+
+	// Maps a .clo file - returns null on failure, with the reason in 'error' if given
+	static std::shared_ptr<const Image> Open(const char* path, IMAGE_ERROR* error = nullptr);
+	// Copies an image from memory
+	static std::shared_ptr<const Image> Create(const void* data, size_t size, IMAGE_ERROR* error = nullptr);
+
+	inline const FileHeader& GetHeader() const { return m_header; }
+	inline Span<uint8_t> GetCode() const { return m_code; }
+	// Initial values of the globals, 4 bytes each
+	inline Span<uint8_t> GetGlobals() const { return m_globals; }
+
+	inline uint32_t GetNumStrings() const { return static_cast<uint32_t>(m_strings.size); }
+	// Text of a string - empty for an index out of range
+	inline std::string_view GetString(uint32_t index) const {
+		if (index >= m_strings.size) return {};
+		return {m_texts.data + m_strings[index].Offset, m_strings[index].Length};
+	}
+	inline uint32_t GetStringHash(uint32_t index) const {
+		return index < m_strings.size ? m_strings[index].Hash : 0;
+	}
+	// Index of the string with the given text, or INVALID_STRING - each text is stored once, so there's only one
+	uint32_t FindString(std::string_view text) const;
+
+	// Which code offsets start an instruction, so branches into the middle of one can be caught - it has an entry for
+	// the end of the code, where branches can also go
+	inline const std::vector<bool>& GetInstructionMap() const {
+		std::call_once(m_mapOnce, &Image::BuildInstructionMap, this);
+		return m_starts;
+	}
+	// Offset of an instruction whose operands run past the end of the code, or the code size if there is none
+	inline size_t GetTruncatedOffset() const {
+		std::call_once(m_mapOnce, &Image::BuildInstructionMap, this);
+		return m_truncated;
+	}
+	// The code decoded into cells - 'handlers' gives the handler address for each opcode and CELL_ value,
+	// or null to store the indexes. Decoding happens once for each set of handlers.
+	const DecodedCode& GetDecodedCode(const void* const* handlers) const;
+	// Checks the code can run without the VM's runtime checks - done on first use, in Verifier.cpp
+	inline const Verification& GetVerification() const {
+		std::call_once(m_verifyOnce, &Image::Verify, this);
+		return m_verification;
+	}
+};
+
+const char* GetImageErrorName(IMAGE_ERROR error);
+const char* GetVerifyResultName(VERIFY_RESULT result);
+// Encoded size of each instruction including its operands, indexed by opcode
+const uint8_t* GetInstructionSizes();
+
+CLARA_NAMESPACE_END
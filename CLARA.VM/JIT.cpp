@@ -0,0 +1,712 @@
+#include "stdafx.h"
+#include <stddef.h>
+#include <CLARA/Assembly.h>
+#include "JIT.h"
+#ifdef CLARA_VM_JIT
+	#ifdef _WIN32
+		#include <windows.h>
+	#else
+		#include <sys/mman.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+CLARA_NAMESPACE_BEGIN
+
+#ifdef CLARA_VM_JIT
+namespace {
+	enum Reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+	enum Cond { CC_B = 2, CC_AE, CC_E, CC_NE, CC_BE, CC_A, CC_L = 12, CC_GE, CC_LE, CC_G };
+	// group opcode extensions of 81 (ALU), C1/D3 (shifts) and F7 (unary)
+	enum { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+	enum { SHIFT_SHL = 4, SHIFT_SHR = 5, SHIFT_SAR = 7 };
+	enum { UNARY_NOT = 2, UNARY_NEG = 3, UNARY_IDIV = 7 };
+
+	// Registers used by native code - the top of the stack is cached in rax, rcx and rdx are scratch
+	const Reg STATE = RBX, SP = R12, STACK = R13, STACK_END = R14, GLOBALS = R15, TOP = RAX;
+#ifdef _WIN32
+	const Reg ARG0 = RCX;
+#else
+	const Reg ARG0 = RDI;
+#endif
+
+	// Just the x86-64 encodings the templates need
+	class Assembler {
+		std::vector<uint8_t> m_code;
+
+		void Rex(bool w, int reg, int index, int base) {
+			uint8_t rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+			if (rex != 0x40) Byte(rex);
+		}
+		// register operand, or [base + disp32], or [base + index * 8 + disp32]
+		void ModRR(int reg, int rm) { Byte(0xC0 | ((reg & 7) << 3) | (rm & 7)); }
+		void ModMem(int reg, int base, int32_t disp) {
+			Byte(0x80 | ((reg & 7) << 3) | (base & 7));
+			if ((base & 7) == RSP) Byte(0x24);
+			Dword(disp);
+		}
+		void ModIdx(int reg, int base, int index, int32_t disp) {
+			Byte(0x84 | ((reg & 7) << 3));
+			Byte(0xC0 | ((index & 7) << 3) | (base & 7));
+			Dword(disp);
+		}
+
+	public:
+		inline size_t Size() const { return m_code.size(); }
+		inline const std::vector<uint8_t>& GetCode() const { return m_code; }
+
+		void Byte(uint8_t b) { m_code.push_back(b); }
+		void Dword(uint32_t d) {
+			for (int i = 0; i < 4; ++i) Byte(static_cast<uint8_t>(d >> (i * 8)));
+		}
+		void Qword(uint64_t q) {
+			Dword(static_cast<uint32_t>(q));
+			Dword(static_cast<uint32_t>(q >> 32));
+		}
+		// Points the rel32 at 'pos' to 'target'
+		void Patch(size_t pos, size_t target) {
+			auto rel = static_cast<uint32_t>(static_cast<int32_t>(target - (pos + 4)));
+			for (int i = 0; i < 4; ++i) m_code[pos + i] = static_cast<uint8_t>(rel >> (i * 8));
+		}
+
+		void Push(Reg r) { Rex(false, 0, 0, r); Byte(0x50 | (r & 7)); }
+		void Pop(Reg r) { Rex(false, 0, 0, r); Byte(0x58 | (r & 7)); }
+		void Ret() { Byte(0xC3); }
+		void Cdq() { Byte(0x99); }
+
+		// 'op r/m, reg' forms - add 01, or 09, and 21, sub 29, xor 31, cmp 39, test 85, mov 89
+		void OpRR(uint8_t op, Reg rm, Reg reg, bool w) { Rex(w, reg, 0, rm); Byte(op); ModRR(reg, rm); }
+		// 'op reg, [base + disp]' forms - add 03, cmp 3B, mov 8B, lea 8D
+		void OpRM(uint8_t op, Reg reg, Reg base, int32_t disp, bool w) { Rex(w, reg, 0, base); Byte(op); ModMem(reg, base, disp); }
+		void MovRR(Reg dst, Reg src) { OpRR(0x89, dst, src, true); }
+		void MovRM(Reg dst, Reg base, int32_t disp, bool w = true) { OpRM(0x8B, dst, base, disp, w); }
+		void MovMR(Reg base, int32_t disp, Reg src, bool w = true) { OpRM(0x89, src, base, disp, w); }
+		void MovRIdx(Reg dst, Reg base, Reg index, int32_t disp) { Rex(true, dst, index, base); Byte(0x8B); ModIdx(dst, base, index, disp); }
+		void MovIdxR(Reg base, Reg index, int32_t disp, Reg src) { Rex(true, src, index, base); Byte(0x89); ModIdx(src, base, index, disp); }
+		void MovRI(Reg dst, uint32_t imm) { Rex(false, 0, 0, dst); Byte(0xB8 | (dst & 7)); Dword(imm); }
+		void MovRI64(Reg dst, uint64_t imm) { Rex(true, 0, 0, dst); Byte(0xB8 | (dst & 7)); Qword(imm); }
+		void MovMI(Reg base, int32_t disp, int32_t imm, bool w) { Rex(w, 0, 0, base); Byte(0xC7); ModMem(0, base, disp); Dword(imm); }
+		void Lea(Reg dst, Reg base, int32_t disp) { OpRM(0x8D, dst, base, disp, true); }
+		void AluRI(int ext, Reg rm, int32_t imm, bool w) { Rex(w, 0, 0, rm); Byte(0x81); ModRR(ext, rm); Dword(imm); }
+		void CmpMI(Reg base, int32_t disp, int32_t imm) { Rex(false, 0, 0, base); Byte(0x81); ModMem(ALU_CMP, base, disp); Dword(imm); }
+		void Shift(int ext, Reg rm, uint8_t count, bool w) { Rex(w, 0, 0, rm); Byte(0xC1); ModRR(ext, rm); Byte(count); }
+		void ShiftCl(int ext, Reg rm) { Rex(false, 0, 0, rm); Byte(0xD3); ModRR(ext, rm); }
+		void Unary(int ext, Reg rm) { Rex(false, 0, 0, rm); Byte(0xF7); ModRR(ext, rm); }
+		void Imul(Reg dst, Reg src) { Rex(false, dst, 0, src); Byte(0x0F); Byte(0xAF); ModRR(dst, src); }
+		void ImulI(Reg dst, Reg src, int32_t imm) { Rex(false, dst, 0, src); Byte(0x69); ModRR(dst, src); Dword(imm); }
+		void Setcc(Cond cc, Reg dst) { Byte(0x0F); Byte(0x90 | cc); ModRR(0, dst); }
+		void Movzx8(Reg dst, Reg src) { Byte(0x0F); Byte(0xB6); ModRR(dst, src); }
+		void JmpM(Reg base, int32_t disp) { Rex(false, 0, 0, base); Byte(0xFF); ModMem(4, base, disp); }
+		// Jumps return the position of their rel32 for patching
+		size_t Jmp() { Byte(0xE9); Dword(0); return Size() - 4; }
+		size_t Jcc(Cond cc) { Byte(0x0F); Byte(0x80 | cc); Dword(0); return Size() - 4; }
+	};
+
+	inline uint64_t MakeValue(BasicType type, uint32_t payload) {
+		return static_cast<uint64_t>(type) | (static_cast<uint64_t>(payload) << 32);
+	}
+
+	// Compiles everything reachable from an entry offset without following calls or returns
+	class RegionCompiler {
+		enum { REACHED = 1, BLOCK = 2 };
+		enum Kind {
+			KIND_NEXT,				// native, continues with the next instruction
+			KIND_BRANCH,			// jt/jnt, in any width
+			KIND_JUMP,				// jmpa/jmpb/jmpw
+			KIND_IF,
+			KIND_CALL,				// leaves native code, and native code resumes after it on return
+			KIND_EXIT,				// always leaves native code
+		};
+		struct Fixup {
+			size_t pos;
+			uint32_t target;
+		};
+
+		Assembler a;
+		const uint8_t* m_code;
+		uint32_t m_codeSize;
+		const uint8_t* m_sizes;
+		const std::vector<bool>& m_starts;
+		uint32_t m_numGlobals;
+
+		std::vector<uint8_t> m_flags;
+		std::vector<Fixup> m_fixups;		// jumps to block starts
+		std::vector<Fixup> m_exits;			// jumps to exit stubs, with the stub key as the target
+		size_t m_epilogue = 0;
+
+		// what's known about the stack at the current point of the block
+		bool m_cached = false;			// the top value is in rax rather than on the stack
+		int m_depthOk = 0;				// values known to be on the stack
+		int m_roomOk = 0;				// free slots known to be above it
+		bool m_live = false;			// false after a jump or exit, until the next block starts
+
+		inline uint32_t Operand(uint32_t x, size_t size) const {
+			auto p = m_code + x + 1;
+			switch (size) {
+			case 1: return p[0];
+			case 2: return p[0] | (p[1] << 8);
+			case 4: return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+			}
+			return 0;
+		}
+		// Where a branch goes - short branches are relative to the next instruction
+		inline uint32_t Target(uint32_t x) const {
+			switch (m_code[x]) {
+			case INSN_JTB: case INSN_JNTB: case INSN_JMPB:
+				return Next(x) + static_cast<uint32_t>(static_cast<int8_t>(Operand(x, 1)));
+			case INSN_JTW: case INSN_JNTW: case INSN_JMPW:
+				return Next(x) + static_cast<uint32_t>(static_cast<int16_t>(Operand(x, 2)));
+			}
+			return Operand(x, 4);
+		}
+		inline bool IsTarget(uint32_t target) const { return target <= m_codeSize && m_starts[target]; }
+		inline uint32_t Next(uint32_t x) const { return x + m_sizes[m_code[x]]; }
+
+		Kind Classify(uint32_t x) const {
+			uint8_t op = m_code[x];
+			if (op >= MAX_INSN || x + m_sizes[op] > m_codeSize) return KIND_EXIT;
+
+			switch (op) {
+			case INSN_NOP: case INSN_PUSHN: case INSN_PUSHB: case INSN_PUSHW: case INSN_PUSHD: case INSN_PUSHF: case INSN_PUSHS:
+			case INSN_POP: case INSN_POPLN: case INSN_SWAP: case INSN_DUP: case INSN_DUPE:
+			case INSN_LOCAL: case INSN_GLOBAL: case INSN_ARRAY:
+			case INSN_INC: case INSN_DEC: case INSN_ADD: case INSN_SUB: case INSN_MUL: case INSN_DIV: case INSN_MOD:
+			case INSN_AND: case INSN_OR: case INSN_XOR: case INSN_SHL: case INSN_SHR: case INSN_NEG: case INSN_NOT:
+			case INSN_CMPNN: case INSN_CMPE: case INSN_CMPNE: case INSN_CMPGE: case INSN_CMPLE: case INSN_CMPG: case INSN_CMPL:
+			case INSN_ENTER:
+				return KIND_NEXT;
+			// globals out of range are left to the interpreter to report
+			case INSN_POPL: case INSN_POPV:
+				return Operand(x, 2) < m_numGlobals ? KIND_NEXT : KIND_EXIT;
+			case INSN_POPLE: case INSN_POPVE:
+			{
+				uint32_t n = Operand(x, 4);
+				return n < m_numGlobals && n < (INT32_MAX / sizeof(Value)) ? KIND_NEXT : KIND_EXIT;
+			}
+			case INSN_JT: case INSN_JNT: case INSN_JTB: case INSN_JTW: case INSN_JNTB: case INSN_JNTW:
+				return IsTarget(Target(x)) ? KIND_BRANCH : KIND_EXIT;
+			case INSN_JMPA: case INSN_JMPB: case INSN_JMPW:
+				return IsTarget(Target(x)) ? KIND_JUMP : KIND_EXIT;
+			case INSN_IF:
+			{
+				uint32_t next = x + 1;
+				return next == m_codeSize || Next(next) <= m_codeSize ? KIND_IF : KIND_EXIT;
+			}
+			case INSN_CALL: case INSN_CALLA:
+				return KIND_CALL;
+			}
+			return KIND_EXIT;
+		}
+
+		// Finds the region, marking the instructions in it and where blocks start
+		void Walk(uint32_t entry) {
+			std::vector<uint32_t> work{entry};
+			m_flags[entry] |= BLOCK;
+
+			auto block = [&](uint32_t target) {
+				m_flags[target] |= BLOCK;
+				work.push_back(target);
+			};
+			while (!work.empty()) {
+				uint32_t x = work.back();
+				work.pop_back();
+				if (x >= m_codeSize || (m_flags[x] & REACHED)) continue;
+				m_flags[x] |= REACHED;
+
+				switch (Classify(x)) {
+				case KIND_NEXT: work.push_back(Next(x)); break;
+				case KIND_BRANCH: work.push_back(Next(x)); block(Target(x)); break;
+				case KIND_JUMP: block(Target(x)); break;
+				case KIND_IF: work.push_back(x + 1); block(x + 1 == m_codeSize ? m_codeSize : Next(x + 1)); break;
+				case KIND_CALL: block(Next(x)); break;
+				case KIND_EXIT: break;
+				}
+			}
+		}
+
+		// Stack state
+		void Flush() {
+			if (!m_cached) return;
+			a.MovMR(SP, 0, TOP);
+			a.AluRI(ALU_ADD, SP, sizeof(Value), true);
+			m_cached = false;
+		}
+		void Top() {
+			if (m_cached) return;
+			a.AluRI(ALU_SUB, SP, sizeof(Value), true);
+			a.MovRM(TOP, SP, 0);
+			m_cached = true;
+		}
+		void Popped(int n) { m_depthOk -= n; m_roomOk += n; }
+		void Pushed(int n) { m_depthOk += n; m_roomOk -= n; }
+
+		// Leaving native code to run the instruction at 'x'
+		void ExitIf(Cond cc, uint32_t x) { m_exits.push_back({a.Jcc(cc), x << 1 | m_cached}); }
+		void Exit(uint32_t x) {
+			m_exits.push_back({a.Jmp(), x << 1 | m_cached});
+			m_live = false;
+		}
+		// Branches to block starts, which always have an empty cache
+		void JumpIf(Cond cc, uint32_t target) {
+			if (target == m_codeSize) ExitIf(cc, target);
+			else m_fixups.push_back({a.Jcc(cc), target});
+		}
+
+		void Need(int n, uint32_t x) {
+			if (n <= m_depthOk) return;
+			a.Lea(RDX, SP, static_cast<int32_t>(sizeof(Value)) * (m_cached - n));
+			a.OpRR(0x39, RDX, STACK, true);
+			ExitIf(CC_B, x);
+			m_depthOk = n;
+		}
+		void Room(int n, uint32_t x) {
+			if (n <= m_roomOk) return;
+			a.Lea(RDX, SP, static_cast<int32_t>(sizeof(Value)) * (m_cached + n));
+			a.OpRR(0x39, RDX, STACK_END, true);
+			ExitIf(CC_A, x);
+			m_roomOk = n;
+		}
+		// Floats take the interpreter's slow paths
+		void GuardInt(Reg r, uint32_t x) {
+			a.AluRI(ALU_CMP, r, Float, false);
+			ExitIf(CC_E, x);
+		}
+		// Makes an integer value from the 32-bit payload in 'r' and leaves it on top
+		void SetInt(Reg r) {
+			a.Shift(SHIFT_SHL, r, 32, true);
+			a.AluRI(ALU_OR, r, Integer, true);
+			if (r != TOP) a.MovRR(TOP, r);
+			m_cached = true;
+		}
+		void Push(uint64_t value, uint32_t x) {
+			Room(1, x);
+			Flush();
+			a.MovRI64(TOP, value);
+			m_cached = true;
+			Pushed(1);
+		}
+		// Checks both operands of a binary operation are integers, with a's payload in edx and b's in ecx
+		void Operands(uint32_t x) {
+			Need(2, x);
+			Top();
+			GuardInt(TOP, x);
+			a.MovRM(RDX, SP, -static_cast<int32_t>(sizeof(Value)));
+			GuardInt(RDX, x);
+			a.MovRR(RCX, TOP);
+			a.Shift(SHIFT_SHR, RCX, 32, true);
+			a.Shift(SHIFT_SHR, RDX, 32, true);
+		}
+		// Replaces a with the integer result from 'r'
+		void Result(Reg r) {
+			SetInt(r);
+			a.AluRI(ALU_SUB, SP, sizeof(Value), true);
+			Popped(1);
+		}
+		void Unary(uint32_t x) {
+			Need(1, x);
+			Top();
+			GuardInt(TOP, x);
+			a.Shift(SHIFT_SHR, TOP, 32, true);
+		}
+		void Condition(uint32_t x) {
+			Unary(x);
+			a.OpRR(0x85, TOP, TOP, false);
+			m_cached = false;
+			Popped(1);
+		}
+
+		void Emit(uint32_t x, Kind kind) {
+			uint8_t op = m_code[x];
+			size_t size = m_sizes[op] - 1;
+			uint32_t operand = kind == KIND_EXIT ? 0 : Operand(x, size);
+			int32_t disp = static_cast<int32_t>(operand * sizeof(Value));
+			const auto frame = static_cast<int32_t>(offsetof(JitState, frame));
+			const auto locals = static_cast<int32_t>(offsetof(VM::Frame, locals));
+			const auto numLocals = static_cast<int32_t>(offsetof(VM::Frame, numLocals));
+
+			if (kind == KIND_EXIT || kind == KIND_CALL) {
+				Exit(x);
+				return;
+			}
+
+			switch (op) {
+			case INSN_NOP: break;
+			case INSN_PUSHN: Push(MakeValue(Null, 0), x); break;
+			case INSN_PUSHB: Push(MakeValue(Integer, static_cast<int8_t>(operand)), x); break;
+			case INSN_PUSHW: Push(MakeValue(Integer, static_cast<int16_t>(operand)), x); break;
+			case INSN_PUSHD: Push(MakeValue(Integer, operand), x); break;
+			case INSN_PUSHF: Push(MakeValue(Float, operand), x); break;
+			case INSN_PUSHS: Push(MakeValue(String, operand), x); break;
+
+			case INSN_POP:
+			{
+				int n = static_cast<int>(operand), left = n;
+				Need(n, x);
+				if (left && m_cached) {
+					m_cached = false;
+					--left;
+				}
+				if (left) a.AluRI(ALU_SUB, SP, left * sizeof(Value), true);
+				Popped(n);
+				break;
+			}
+			case INSN_POPLN:
+				Need(1, x);
+				a.MovRM(RDX, STATE, frame);
+				a.CmpMI(RDX, numLocals, operand);
+				ExitIf(CC_BE, x);
+				Top();
+				a.MovRM(RDX, RDX, locals, false);
+				a.MovIdxR(STACK, RDX, disp, TOP);
+				m_cached = false;
+				Popped(1);
+				break;
+			case INSN_POPL: case INSN_POPLE:
+				Need(1, x);
+				Top();
+				a.MovMR(GLOBALS, disp, TOP);
+				m_cached = false;
+				Popped(1);
+				break;
+			case INSN_POPV: case INSN_POPVE:
+				Need(1, x);
+				Top();
+				a.MovMR(GLOBALS, disp, TOP);
+				break;
+			case INSN_SWAP:
+				Need(2, x);
+				Top();
+				a.MovRM(RDX, SP, -static_cast<int32_t>(sizeof(Value)));
+				a.MovMR(SP, -static_cast<int32_t>(sizeof(Value)), TOP);
+				a.MovRR(TOP, RDX);
+				break;
+			case INSN_DUP:
+				Need(1, x);
+				Room(1, x);
+				if (m_cached) {
+					a.MovMR(SP, 0, TOP);
+					a.AluRI(ALU_ADD, SP, sizeof(Value), true);
+				}
+				else a.MovRM(TOP, SP, -static_cast<int32_t>(sizeof(Value)));
+				m_cached = true;
+				Pushed(1);
+				break;
+			case INSN_DUPE:
+			{
+				int n = static_cast<int>(operand);
+				Need(n, x);
+				Room(n, x);
+				Flush();
+				for (int i = 0; i < n; ++i) {
+					a.MovRM(RDX, SP, (i - n) * static_cast<int32_t>(sizeof(Value)));
+					a.MovMR(SP, i * static_cast<int32_t>(sizeof(Value)), RDX);
+				}
+				if (n) a.AluRI(ALU_ADD, SP, n * sizeof(Value), true);
+				Pushed(n);
+				break;
+			}
+
+			case INSN_LOCAL:
+				Need(1, x);
+				Top();
+				GuardInt(TOP, x);
+				a.MovRR(RCX, TOP);
+				a.Shift(SHIFT_SHR, RCX, 32, true);
+				a.MovRM(RDX, STATE, frame);
+				a.OpRM(0x3B, RCX, RDX, numLocals, false);
+				ExitIf(CC_AE, x);
+				a.OpRM(0x03, RCX, RDX, locals, false);
+				a.MovRIdx(TOP, STACK, RCX, 0);
+				break;
+			case INSN_GLOBAL:
+				Need(1, x);
+				Top();
+				GuardInt(TOP, x);
+				a.MovRR(RCX, TOP);
+				a.Shift(SHIFT_SHR, RCX, 32, true);
+				a.AluRI(ALU_CMP, RCX, static_cast<int32_t>(m_numGlobals), false);
+				ExitIf(CC_AE, x);
+				a.MovRIdx(TOP, GLOBALS, RCX, 0);
+				break;
+			case INSN_ARRAY:
+				Operands(x);
+				a.ImulI(RCX, RCX, operand);
+				a.OpRR(0x01, RDX, RCX, false);
+				Result(RDX);
+				break;
+
+			case INSN_INC: case INSN_DEC:
+				Unary(x);
+				a.AluRI(op == INSN_INC ? ALU_ADD : ALU_SUB, TOP, 1, false);
+				SetInt(TOP);
+				break;
+			case INSN_NEG: case INSN_NOT:
+				Unary(x);
+				a.Unary(op == INSN_NEG ? UNARY_NEG : UNARY_NOT, TOP);
+				SetInt(TOP);
+				break;
+			case INSN_ADD: case INSN_SUB: case INSN_AND: case INSN_OR: case INSN_XOR:
+			{
+				static const uint8_t ops[] = {0x01, 0x29, 0, 0, 0, 0x21, 0x09, 0x31};
+				Operands(x);
+				a.OpRR(ops[op == INSN_ADD ? 0 : op == INSN_SUB ? 1 : op - INSN_AND + 5], RDX, RCX, false);
+				Result(RDX);
+				break;
+			}
+			case INSN_MUL:
+				Operands(x);
+				a.Imul(RDX, RCX);
+				Result(RDX);
+				break;
+			case INSN_SHL: case INSN_SHR:
+				Operands(x);
+				a.ShiftCl(op == INSN_SHL ? SHIFT_SHL : SHIFT_SAR, RDX);
+				Result(RDX);
+				break;
+			case INSN_DIV: case INSN_MOD:
+				// dividing by 0 or -1 is left to the interpreter
+				Operands(x);
+				a.OpRR(0x85, RCX, RCX, false);
+				ExitIf(CC_E, x);
+				a.AluRI(ALU_CMP, RCX, -1, false);
+				ExitIf(CC_E, x);
+				a.OpRR(0x89, RAX, RDX, false);
+				a.Cdq();
+				a.Unary(UNARY_IDIV, RCX);
+				Result(op == INSN_DIV ? RAX : RDX);
+				break;
+
+			case INSN_CMPNN:
+				Need(1, x);
+				Top();
+				a.OpRR(0x85, TOP, TOP, false);
+				a.Setcc(CC_NE, TOP);
+				a.Movzx8(TOP, TOP);
+				SetInt(TOP);
+				break;
+			case INSN_CMPE: case INSN_CMPNE: case INSN_CMPGE: case INSN_CMPLE: case INSN_CMPG: case INSN_CMPL:
+			{
+				static const Cond conds[] = {CC_E, CC_NE, CC_GE, CC_LE, CC_G, CC_L};
+				Operands(x);
+				a.OpRR(0x39, RDX, RCX, false);
+				a.Setcc(conds[op - INSN_CMPE], TOP);
+				a.Movzx8(TOP, TOP);
+				Result(TOP);
+				break;
+			}
+
+			case INSN_IF:
+				Condition(x);
+				JumpIf(CC_E, x + 1 == m_codeSize ? m_codeSize : Next(x + 1));
+				break;
+			case INSN_JT: case INSN_JTB: case INSN_JTW:
+				Condition(x);
+				JumpIf(CC_NE, Target(x));
+				break;
+			case INSN_JNT: case INSN_JNTB: case INSN_JNTW:
+				Condition(x);
+				JumpIf(CC_E, Target(x));
+				break;
+			case INSN_JMPA: case INSN_JMPB: case INSN_JMPW:
+				Flush();
+				if (Target(x) == m_codeSize) Exit(m_codeSize);
+				else {
+					m_fixups.push_back({a.Jmp(), Target(x)});
+					m_live = false;
+				}
+				break;
+
+			case INSN_ENTER:
+			{
+				int n = static_cast<int>(operand);
+				Room(n, x);
+				Flush();
+				a.MovRM(RDX, STATE, frame);
+				a.MovRR(RCX, SP);
+				a.OpRR(0x29, RCX, STACK, true);
+				a.Shift(SHIFT_SHR, RCX, 3, true);
+				a.MovMR(RDX, locals, RCX, false);
+				a.MovMI(RDX, numLocals, n, false);
+				for (int i = 0; i < n; ++i)
+					a.MovMI(SP, i * static_cast<int32_t>(sizeof(Value)), 0, true);
+				if (n) a.AluRI(ALU_ADD, SP, n * sizeof(Value), true);
+				Pushed(n);
+				break;
+			}
+			}
+		}
+
+	public:
+		RegionCompiler(const Image& image, uint32_t numGlobals) :
+			m_code(image.GetCode().data),
+			m_codeSize(static_cast<uint32_t>(image.GetCode().size)),
+			m_sizes(GetInstructionSizes()),
+			m_starts(image.GetInstructionMap()),
+			m_numGlobals(numGlobals),
+			m_flags(image.GetCode().size + 1)
+		{ }
+
+		// Generates the code, and the position of each block start in it (-1 for offsets outside the region)
+		bool Compile(uint32_t entry, std::vector<int32_t>& labels) {
+			static_assert(Null == 0 && sizeof(Value) == 8, "templates assume null is all zero and values fit a register");
+			if (entry >= m_codeSize) return false;
+			Walk(entry);
+
+			// exits restore the registers and return the offset to continue from in eax
+			m_epilogue = a.Size();
+			a.MovMR(STATE, offsetof(JitState, sp), SP);
+			a.Pop(R15);
+			a.Pop(R14);
+			a.Pop(R13);
+			a.Pop(R12);
+			a.Pop(RBX);
+			a.Ret();
+
+			labels.assign(m_codeSize + 1, -1);
+			for (uint32_t x = 0; x < m_codeSize; ++x) {
+				if (!(m_flags[x] & REACHED)) continue;
+				if (m_flags[x] & BLOCK) {
+					if (m_live) Flush();
+					labels[x] = static_cast<int32_t>(a.Size());
+					m_cached = false;
+					m_depthOk = m_roomOk = 0;
+					m_live = true;
+				}
+
+				auto kind = Classify(x);
+				Emit(x, kind);
+				if (m_live && kind != KIND_EXIT && Next(x) == m_codeSize) Exit(m_codeSize);
+			}
+
+			for (auto& fixup : m_fixups)
+				a.Patch(fixup.pos, labels[fixup.target]);
+
+			// exit stubs, one for each offset and cache state
+			std::sort(m_exits.begin(), m_exits.end(), [](const Fixup& l, const Fixup& r) { return l.target < r.target; });
+			size_t stub = 0;
+			for (size_t i = 0; i < m_exits.size(); ++i) {
+				uint32_t key = m_exits[i].target;
+				if (!i || key != m_exits[i - 1].target) {
+					stub = a.Size();
+					if (key & 1) {
+						a.MovMR(SP, 0, TOP);
+						a.AluRI(ALU_ADD, SP, sizeof(Value), true);
+					}
+					a.MovRI(RAX, key >> 1);
+					a.Patch(a.Jmp(), m_epilogue);
+				}
+				a.Patch(m_exits[i].pos, stub);
+			}
+			return labels[entry] >= 0;
+		}
+
+		inline const std::vector<uint8_t>& GetCode() const { return a.GetCode(); }
+	};
+}
+#endif
+
+JIT::JIT(std::shared_ptr<const Image> image, size_t numGlobals, uint32_t threshold) :
+	m_image(std::move(image)),
+	m_numGlobals(static_cast<uint32_t>(numGlobals)),
+	m_threshold(threshold),
+	m_entries(m_image->GetCode().size + 1),
+	m_counts(m_image->GetCode().size + 1)
+{
+#ifdef CLARA_VM_JIT
+	// saves the registers native code uses, loads them from the state and jumps to the entry
+	Assembler a;
+	a.Push(RBX);
+	a.Push(R12);
+	a.Push(R13);
+	a.Push(R14);
+	a.Push(R15);
+	a.MovRR(STATE, ARG0);
+	a.MovRM(SP, STATE, offsetof(JitState, sp));
+	a.MovRM(STACK, STATE, offsetof(JitState, stack));
+	a.MovRM(STACK_END, STATE, offsetof(JitState, stackEnd));
+	a.MovRM(GLOBALS, STATE, offsetof(JitState, globals));
+	a.JmpM(STATE, offsetof(JitState, entry));
+	m_trampoline = Allocate(a.GetCode());
+#endif
+}
+
+JIT::~JIT() {
+#ifdef CLARA_VM_JIT
+	for (auto& memory : m_memory) {
+#ifdef _WIN32
+		VirtualFree(memory.first, 0, MEM_RELEASE);
+#else
+		munmap(memory.first, memory.second);
+#endif
+	}
+#endif
+}
+
+bool JIT::IsSupported() {
+#ifdef CLARA_VM_JIT
+	return true;
+#else
+	return false;
+#endif
+}
+
+void* JIT::Allocate(const std::vector<uint8_t>& code) {
+#ifdef CLARA_VM_JIT
+	// written then made executable, so the pages are never writable and executable at once
+#ifdef _WIN32
+	size_t size = code.size();
+	void* memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!memory) return nullptr;
+	memcpy(memory, code.data(), code.size());
+	DWORD old;
+	if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old)) {
+		VirtualFree(memory, 0, MEM_RELEASE);
+		return nullptr;
+	}
+	FlushInstructionCache(GetCurrentProcess(), memory, size);
+#else
+	size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t size = (code.size() + page - 1) / page * page;
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return nullptr;
+	memcpy(memory, code.data(), code.size());
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC)) {
+		munmap(memory, size);
+		return nullptr;
+	}
+#endif
+	m_memory.emplace_back(memory, size);
+	return memory;
+#else
+	return nullptr;
+#endif
+}
+
+const void* JIT::Compile(uint32_t offset) {
+#ifdef CLARA_VM_JIT
+	if (!m_trampoline) return nullptr;
+
+	RegionCompiler compiler(*m_image, m_numGlobals);
+	std::vector<int32_t> labels;
+	if (!compiler.Compile(offset, labels)) return nullptr;
+
+	auto memory = static_cast<const uint8_t*>(Allocate(compiler.GetCode()));
+	if (!memory) return nullptr;
+
+	// blocks already compiled as part of another region keep that code
+	for (size_t x = 0; x < labels.size(); ++x) {
+		if (labels[x] >= 0 && !m_entries[x])
+			m_entries[x] = memory + labels[x];
+	}
+	return m_entries[offset];
+#else
+	(void)offset;
+	return nullptr;
+#endif
+}
+
+uint32_t JIT::Run(JitState& state) {
+	return reinterpret_cast<uint32_t(*)(JitState*)>(m_trampoline)(&state);
+}
+
+CLARA_NAMESPACE_END
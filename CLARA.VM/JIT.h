@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <CLARA/CLARA.h>
+#include "Image.h"
+#include "Value.h"
+#include "VM.h"
+
+// Native code is generated on x86-64 unless CLARA_VM_NO_JIT is defined - elsewhere everything is interpreted
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(CLARA_VM_NO_JIT)
+	#define CLARA_VM_JIT
+#endif
+
+CLARA_NAMESPACE_BEGIN
+
+// What native code runs on - the VM fills it in each time it enters native code, and gets 'sp' back
+struct JitState {
+	Value* sp;
+	Value* stack;
+	Value* stackEnd;
+	Value* globals;
+	VM::Frame* frame;			// the current frame, for enter and locals
+	const void* entry;			// where to start
+};
+
+// Template JIT for the hot parts of a script
+//
+// Code is compiled a region at a time: everything reachable from an entry offset without following calls or returns.
+// Each instruction is copied from a machine code template with its operands patched in, keeping the top of the stack
+// in a register within a block. Only the integer fast paths are native - anything else (floats, failed checks,
+// calls, returns, external functions...) leaves native code at the start of that instruction with the stack written
+// back, so the interpreter runs it exactly as it would have and reports any errors itself.
+//
+// The interpreter enters native code where it calls a function, branches backwards or returns, once that offset has
+// been reached 'threshold' times.
+class JIT {
+	std::shared_ptr<const Image> m_image;
+	uint32_t m_numGlobals;
+	uint32_t m_threshold;
+
+	std::vector<const void*> m_entries;		// native code for each code offset, where there is some
+	std::vector<uint32_t> m_counts;			// times each offset has been entered by the interpreter
+	std::vector<std::pair<void*, size_t>> m_memory;
+	void* m_trampoline = nullptr;			// saves registers, loads the state and jumps to the entry
+
+	void* Allocate(const std::vector<uint8_t>& code);
+	const void* Compile(uint32_t offset);
+
+public:
+	JIT(std::shared_ptr<const Image> image, size_t numGlobals, uint32_t threshold);
+	JIT(const JIT&) = delete;
+	JIT& operator=(const JIT&) = delete;
+	~JIT();
+
+	// Whether native code can be generated on this platform
+	static bool IsSupported();
+
+	// Native code for a code offset the interpreter is about to run, compiling it if it's now hot
+	inline const void* Lookup(uint32_t offset) {
+		if (auto entry = m_entries[offset]) return entry;
+		if (++m_counts[offset] != m_threshold) return nullptr;
+		return Compile(offset);
+	}
+
+	// Runs native code until it leaves - returns the code offset for the interpreter to continue from
+	uint32_t Run(JitState& state);
+};
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,78 @@
+#include "stdafx.h"
+#include <CLARA/Assembly.h>
+#include "Profile.h"
+
+CLARA_NAMESPACE_BEGIN
+
+namespace {
+	struct Row {
+		uint32_t first;
+		uint32_t second;			// MAX_INSN for a single instruction
+		Profile::Counter counter;
+	};
+
+	// Everything which ran, instructions then pairs, each most executed first
+	std::vector<Row> GetRows(const Profile& profile, bool pairs) {
+		std::vector<Row> rows;
+		for (uint32_t first = 0; first < MAX_INSN; ++first) {
+			auto insn = static_cast<CLARA_INSTRUCTION>(first);
+			if (!pairs) {
+				if (profile.Get(insn).count) rows.push_back({first, MAX_INSN, profile.Get(insn)});
+				continue;
+			}
+			for (uint32_t second = 0; second < MAX_INSN; ++second) {
+				auto& counter = profile.Get(insn, static_cast<CLARA_INSTRUCTION>(second));
+				if (counter.count) rows.push_back({first, second, counter});
+			}
+		}
+		std::stable_sort(rows.begin(), rows.end(), [](const Row& l, const Row& r) { return l.counter.count > r.counter.count; });
+		return rows;
+	}
+}
+
+void Profile::Clear() {
+	std::fill(std::begin(m_insns), std::end(m_insns), Counter());
+	for (auto& counters : m_pairs)
+		std::fill(std::begin(counters), std::end(counters), Counter());
+	m_last = m_prev = NONE;
+	m_lastCycles = 0;
+}
+
+std::string Profile::ToCSV() const {
+	std::string csv = "kind,first,second,count,cycles\n";
+	for (int pairs = 0; pairs < 2; ++pairs) {
+		for (auto& row : GetRows(*this, pairs != 0)) {
+			csv += pairs ? "pair," : "op,";
+			csv += g_Instructions[row.first].name;
+			csv += ",";
+			if (pairs) csv += g_Instructions[row.second].name;
+			csv += "," + std::to_string(row.counter.count) + "," + std::to_string(row.counter.cycles) + "\n";
+		}
+	}
+	return csv;
+}
+
+std::string Profile::ToJSON() const {
+	std::string json = "{";
+	for (int pairs = 0; pairs < 2; ++pairs) {
+		json += pairs ? ",\n\"pairs\": [" : "\n\"instructions\": [";
+		bool first = true;
+		for (auto& row : GetRows(*this, pairs != 0)) {
+			json += first ? "\n" : ",\n";
+			first = false;
+			json += std::string("\t{\"") + (pairs ? "first" : "name") + "\": \"" + g_Instructions[row.first].name + "\"";
+			if (pairs) json += std::string(", \"second\": \"") + g_Instructions[row.second].name + "\"";
+			json += ", \"count\": " + std::to_string(row.counter.count) + ", \"cycles\": " + std::to_string(row.counter.cycles) + "}";
+		}
+		json += "\n]";
+	}
+	return json + "\n}\n";
+}
+
+bool Profile::Report(PROFILE_FORMAT format, CLARA_CONTEXT context) const {
+	auto text = format == PROFILE_JSON ? ToJSON() : ToCSV();
+	auto result = context ? ContextOutput(context, text.c_str()) : Output(text.c_str());
+	return result == CLARA_ERROR_NONE;
+}
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,85 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <CLARA/CLARA.h>
+#if defined(_M_X64) || defined(_M_IX86)
+	#include <intrin.h>
+	#define CLARA_VM_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define CLARA_VM_RDTSC
+#endif
+
+CLARA_NAMESPACE_BEGIN
+
+enum PROFILE_FORMAT {
+	PROFILE_CSV,				// one 'kind,first,second,count,cycles' row per instruction ('op') or pair ('pair')
+	PROFILE_JSON,				// {"instructions": [...], "pairs": [...]}, with the same fields
+};
+
+// Execution counts and timings of each instruction and each pair of consecutive instructions the interpreter runs
+//
+// An instruction's time runs from its dispatch to the next one, so it includes the dispatch, and a pair's is the
+// time of both. Timings are in TSC cycles where there's a TSC, otherwise in steady_clock ticks.
+//
+// The VM only fills one in when it's built with CLARA_VM_PROFILE defined - otherwise there are no hooks at all.
+class Profile {
+public:
+	struct Counter {
+		uint64_t count = 0;
+		uint64_t cycles = 0;
+	};
+
+private:
+	enum : uint32_t { NONE = UINT32_MAX };
+
+	Counter m_insns[MAX_INSN];
+	Counter m_pairs[MAX_INSN][MAX_INSN];	// by first then second instruction
+	uint32_t m_last = NONE;					// the running instruction
+	uint32_t m_prev = NONE;					// and the one before it
+	uint64_t m_time = 0;					// when the running instruction was dispatched
+	uint64_t m_lastCycles = 0;				// time taken by m_prev
+
+public:
+	static inline uint64_t Timestamp() {
+#ifdef CLARA_VM_RDTSC
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+	}
+
+	// Called as each instruction is dispatched - ends the one before it, anything past MAX_INSN ends the sequence
+	inline void Step(uint32_t insn) {
+		uint64_t now = Timestamp();
+		if (m_last != NONE) {
+			uint64_t cycles = now - m_time;
+			m_insns[m_last].cycles += cycles;
+			if (m_prev != NONE) m_pairs[m_prev][m_last].cycles += m_lastCycles + cycles;
+			m_lastCycles = cycles;
+		}
+		if (insn >= MAX_INSN) insn = NONE;
+		else {
+			++m_insns[insn].count;
+			if (m_last != NONE) ++m_pairs[m_last][insn].count;
+		}
+		m_prev = m_last;
+		m_last = insn;
+		m_time = now;
+	}
+	// Ends the running instruction when the interpreter returns, so time spent in the host isn't counted
+	inline void Pause() { Step(NONE); }
+	void Clear();
+
+	inline const Counter& Get(CLARA_INSTRUCTION insn) const { return m_insns[insn]; }
+	inline const Counter& Get(CLARA_INSTRUCTION first, CLARA_INSTRUCTION second) const { return m_pairs[first][second]; }
+
+	// The counters run, most executed first
+	std::string ToCSV() const;
+	std::string ToJSON() const;
+	// Passes the profile to the output handler of a context, or the default one - returns false if the handler asks to stop
+	bool Report(PROFILE_FORMAT format, CLARA_CONTEXT context = nullptr) const;
+};
+
+CLARA_NAMESPACE_END
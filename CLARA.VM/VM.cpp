@@ -0,0 +1,803 @@
+#include "stdafx.h"
+#include <CLARA/Assembly.h>
+#include "VM.h"
+#include "JIT.h"
+#include "Profile.h"
+
+// Direct-threaded dispatch through a table of label addresses where the compiler supports it
+// Define CLARA_VM_NO_COMPUTED_GOTO to use the switch everywhere
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CLARA_VM_NO_COMPUTED_GOTO)
+	#define CLARA_VM_COMPUTED_GOTO
+#endif
+
+CLARA_NAMESPACE_BEGIN
+
+static inline uint16_t Read16(const uint8_t* p) {
+	return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+static inline uint32_t Read32(const uint8_t* p) {
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Index of the entry in a switch table which 'key' selects, or -1 for the default
+// The entries are 'case' instructions sorted by key - sw needs an exact match, found directly when the keys are
+// consecutive, while rsw takes the last entry at or below the key
+static int32_t FindCase(const uint8_t* table, size_t stride, uint32_t count, int32_t key, bool range) {
+	auto keyAt = [&](uint32_t i) { return static_cast<int32_t>(Read32(table + i * stride + 1)); };
+	if (!count) return -1;
+
+	int32_t first = keyAt(0);
+	if (!range && static_cast<int64_t>(keyAt(count - 1)) - first == count - 1) {
+		int64_t i = static_cast<int64_t>(key) - first;
+		return i >= 0 && i < count ? static_cast<int32_t>(i) : -1;
+	}
+
+	// find the first entry above the key
+	uint32_t lo = 0, hi = count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (keyAt(mid) <= key) lo = mid + 1;
+		else hi = mid;
+	}
+	if (range) return static_cast<int32_t>(lo) - 1;
+	return lo && keyAt(lo - 1) == key ? static_cast<int32_t>(lo - 1) : -1;
+}
+
+const char* GetStatusName(VM_STATUS status) {
+	switch (status) {
+	case VM_READY: return "ready";
+	case VM_DONE: return "done";
+	case VM_BREAK: return "break";
+	case VM_THROWN: return "thrown";
+	case VM_ERROR_NOT_LOADED: return "no script loaded";
+	case VM_ERROR_INVALID_INSTRUCTION: return "invalid instruction";
+	case VM_ERROR_UNSUPPORTED: return "unsupported instruction";
+	case VM_ERROR_STACK_OVERFLOW: return "stack overflow";
+	case VM_ERROR_STACK_UNDERFLOW: return "stack underflow";
+	case VM_ERROR_BAD_GLOBAL: return "global index out of range";
+	case VM_ERROR_BAD_LOCAL: return "local index out of range";
+	case VM_ERROR_BAD_JUMP: return "branch target out of range";
+	case VM_ERROR_DIVIDE_BY_ZERO: return "divide by zero";
+	case VM_ERROR_EXTERNAL: return "external function failed";
+	}
+	return "unknown";
+}
+
+VM::VM() {
+#ifdef CLARA_VM_PROFILE
+	m_profile = std::make_unique<Profile>();
+#endif
+}
+VM::~VM() = default;
+
+bool VM::SetJitThreshold(uint32_t threshold) {
+#ifdef CLARA_VM_PROFILE
+	// native code would hide the instructions it runs from the profile
+	m_jitThreshold = 0;
+	return false;
+#else
+	m_jitThreshold = threshold;
+	return JIT::IsSupported();
+#endif
+}
+
+bool VM::Load(std::shared_ptr<const Image> image) {
+	m_image = std::move(image);
+	m_status = VM_ERROR_NOT_LOADED;
+	m_jit.reset();
+	if (!m_image) return false;
+
+	auto& header = m_image->GetHeader();
+	m_stack.assign(header.StackSize ? header.StackSize : CLARA_VM_DEFAULT_STACK_SIZE, Value::MakeNull());
+	m_globals.resize(header.NumGlobals);
+	if (m_jitThreshold && JIT::IsSupported())
+		m_jit = std::make_unique<JIT>(m_image, m_globals.size(), m_jitThreshold);
+	Reset();
+	return true;
+}
+bool VM::Load(const char* path) {
+	return Load(Image::Open(path));
+}
+bool VM::Load(const void* image, size_t size) {
+	return Load(Image::Create(image, size));
+}
+
+void VM::Reset() {
+	if (!m_image) return;
+
+	auto init = m_image->GetGlobals();
+	for (size_t i = 0; i < m_globals.size(); ++i)
+		m_globals[i] = Value::MakeInt(static_cast<int32_t>(Read32(&init[i * 4])));
+
+	// the header's stack size is only a hint, so the verified one has to fit in what was allocated
+	auto& verification = m_image->GetVerification();
+	m_unchecked = m_verify && verification.result == VERIFY_OK && verification.stackSize <= m_stack.size();
+
+	m_decoded = nullptr;
+	if (m_predecode) Predecode();
+
+	m_frames.clear();
+	m_frames.push_back({0, 0, 0, 0});
+	m_sp = 0;
+	m_pc = 0;
+	m_errorOffset = 0;
+	m_throwCode = 0;
+	m_status = VM_READY;
+}
+
+void VM::Predecode() {
+	const void* const* handlers = nullptr;
+	if (m_unchecked) Execute<true, false>(&handlers);
+	else Execute<true, true>(&handlers);
+	m_decoded = &m_image->GetDecodedCode(handlers);
+	m_decodedUnchecked = m_unchecked;
+}
+
+VM_STATUS VM::Run() {
+	if (m_status != VM_READY && m_status != VM_BREAK)
+		return m_status;
+	// the cells are indexed the same whichever handlers they have, so switching mid-run keeps the position
+	if (m_decoded && m_decodedUnchecked != m_unchecked) Predecode();
+	VM_STATUS status;
+	if (m_decoded) status = m_unchecked ? Execute<true, false>() : Execute<true, true>();
+	else status = m_unchecked ? Execute<false, false>() : Execute<false, true>();
+#ifdef CLARA_VM_PROFILE
+	m_profile->Pause();
+#endif
+	return status;
+}
+
+template<bool TDecoded, bool TChecked>
+VM_STATUS VM::Execute(const void* const** handlers) {
+	// raw bytecode runs straight from the image, so every instruction must fit inside it and branches must land on one
+	// verified code has been through all of it, but computed branches still need the map
+	auto code_ = m_image->GetCode();
+	const uint8_t* const code = code_.data;
+	const uint8_t* const codeEnd = code_.end();
+	const uint32_t codeSize = static_cast<uint32_t>(code_.size);
+	const std::vector<bool>* starts = nullptr;
+	if (!TDecoded && !handlers) {
+		starts = &m_image->GetInstructionMap();
+		if (m_image->GetTruncatedOffset() < codeSize)
+			return Fail(VM_ERROR_INVALID_INSTRUCTION, static_cast<uint32_t>(m_image->GetTruncatedOffset()));
+	}
+	const uint8_t* const sizes = GetInstructionSizes();
+	const uint8_t* ip = code + (TDecoded ? 0 : m_pc);
+	const uint8_t* insn = ip;			// start of the executing instruction
+
+	// predecoded cells end with an end cell, so there's no need to check for the end of the code
+	const Cell* const cells = TDecoded && m_decoded ? m_decoded->cells.data() : nullptr;
+	const Cell* cp = cells + (TDecoded ? m_pc : 0);
+	const Cell* cell = cp;				// the executing cell
+	const Cell* const lastCell = cells ? &m_decoded->cells.back() : nullptr;
+
+	Value* const stack = m_stack.data();
+	Value* const stackEnd = stack + m_stack.size();
+	Value* sp = stack + m_sp;
+	Value* const globals = m_globals.data();
+	const size_t numGlobals = m_globals.size();
+
+#define OFFSET(p) static_cast<uint32_t>((p) - code)
+#define POS() (TDecoded ? static_cast<uint32_t>(cp - cells) : OFFSET(ip))
+#define SET_POS(pos) (TDecoded ? (void)(cp = cells + (pos)) : (void)(ip = code + (pos)))
+#define ERROR_OFFSET() (TDecoded ? m_decoded->offsets[cell - cells] : OFFSET(insn))
+#define SAVE() (m_sp = sp - stack, m_pc = POS())
+#define LOAD() (sp = stack + m_sp)
+#define FAIL(status) do { \
+		m_sp = sp - stack; \
+		m_pc = TDecoded ? static_cast<uint32_t>(cell - cells) : OFFSET(insn); \
+		return Fail(status, ERROR_OFFSET()); \
+	} while (0)
+// the checks the verifier makes ahead of time are left out of the unchecked interpreter
+#define NEED(n) do { if (TChecked && sp - stack < static_cast<ptrdiff_t>(n)) FAIL(VM_ERROR_STACK_UNDERFLOW); } while (0)
+#define ROOM(n) do { if (TChecked && stackEnd - sp < static_cast<ptrdiff_t>(n)) FAIL(VM_ERROR_STACK_OVERFLOW); } while (0)
+// operands - cells hold them already widened, with pushed and thrown immediates sign-extended
+#define IMM8() (TDecoded ? cell->nOperand : (ip += 1, static_cast<int8_t>(ip[-1])))
+#define UIMM8() (TDecoded ? static_cast<uint8_t>(cell->dwOperand) : (ip += 1, ip[-1]))
+#define IMM16() (TDecoded ? cell->nOperand : (ip += 2, static_cast<int16_t>(Read16(ip - 2))))
+#define UIMM16() (TDecoded ? static_cast<uint16_t>(cell->dwOperand) : (ip += 2, Read16(ip - 2)))
+#define IMM32() (TDecoded ? cell->nOperand : (ip += 4, static_cast<int32_t>(Read32(ip - 4))))
+#define UIMM32() (TDecoded ? cell->dwOperand : (ip += 4, Read32(ip - 4)))
+// branch operands are cell indexes in decoded code, while popped targets are always code offsets
+// short branches are relative to the next instruction
+#define TARGET() UIMM32()
+#define SHORT_TARGET8() (TDecoded ? cell->dwOperand : (ip += 1, OFFSET(ip) + static_cast<uint32_t>(static_cast<int8_t>(ip[-1]))))
+#define SHORT_TARGET16() (TDecoded ? cell->dwOperand : (ip += 2, OFFSET(ip) + static_cast<uint32_t>(static_cast<int16_t>(Read16(ip - 2)))))
+#define OFFSET_TARGET(offset) (TDecoded ? m_decoded->Find(offset) : (offset))
+// native code is found by code offset, and leaves at one (which may be the end of the code)
+#define POS_OFFSET(pos) (TDecoded ? m_decoded->offsets[pos] : (pos))
+#define OFFSET_POS(offset) (TDecoded ? ((offset) == codeSize ? static_cast<uint32_t>(lastCell - cells) : m_decoded->Find(offset)) : (offset))
+#define JIT_ENTER() do { \
+		const void* entry_; \
+		if (m_jit && (entry_ = m_jit->Lookup(POS_OFFSET(POS())))) { \
+			JitState state_ = {sp, stack, stackEnd, globals, &m_frames.back(), entry_}; \
+			uint32_t exit_ = m_jit->Run(state_); \
+			sp = state_.sp; \
+			SET_POS(OFFSET_POS(exit_)); \
+		} \
+	} while (0)
+#define BAD_TARGET(t) (TDecoded ? (t) == INVALID_CELL : (t) > codeSize || !(*starts)[t])
+#define CHECK_TARGET(t) do { if (TChecked && BAD_TARGET(t)) FAIL(VM_ERROR_BAD_JUMP); } while (0)
+// popped targets can't be verified, so JUMP/CALL leaving them to TChecked isn't enough
+#define CHECK_COMPUTED_TARGET(t) do { if (!TChecked && BAD_TARGET(t)) FAIL(VM_ERROR_BAD_JUMP); } while (0)
+#define CURRENT_POS() (TDecoded ? static_cast<uint32_t>(cell - cells) : OFFSET(insn))
+#define JUMP(target) do { \
+		uint32_t t_ = (target); \
+		CHECK_TARGET(t_); \
+		SET_POS(t_); \
+		if (t_ <= CURRENT_POS()) JIT_ENTER(); \
+	} while (0)
+#define CALL(target) do { \
+		uint32_t t_ = (target); \
+		CHECK_TARGET(t_); \
+		if (TChecked && m_frames.size() >= m_stack.size()) FAIL(VM_ERROR_STACK_OVERFLOW); \
+		auto base_ = static_cast<uint32_t>(sp - stack); \
+		m_frames.push_back({POS(), base_, base_, 0}); \
+		SET_POS(t_); \
+		JIT_ENTER(); \
+	} while (0)
+#define GLOBAL(index) do { if (TChecked && (index) >= numGlobals) FAIL(VM_ERROR_BAD_GLOBAL); } while (0)
+// profiling builds report each instruction as it's dispatched - cells dispatched by address are looked up in the code
+#ifdef CLARA_VM_PROFILE
+	#define PROFILE(op) m_profile->Step(static_cast<uint32_t>(op))
+	#define CELL_INSN() (cell == lastCell ? CELL_END : code[m_decoded->offsets[cell - cells]])
+#else
+	#define PROFILE(op)
+#endif
+
+// binary operations pop b and replace a with the result
+#define BINARY_ARITH(op) { \
+		NEED(2); \
+		Value& a = sp[-2]; \
+		const Value& b = sp[-1]; \
+		if (a.IsFloat() || b.IsFloat()) a = Value::MakeFloat(a.ToFloat() op b.ToFloat()); \
+		else a = Value::MakeInt(static_cast<int32_t>(static_cast<uint32_t>(a.nValue) op static_cast<uint32_t>(b.nValue))); \
+		--sp; \
+	}
+#define BINARY_BITWISE(expr) { \
+		NEED(2); \
+		int32_t l = sp[-2].ToInt(), r = sp[-1].ToInt(); \
+		sp[-2] = Value::MakeInt(expr); \
+		--sp; \
+	}
+#define COMPARE(op) { \
+		NEED(2); \
+		const Value& a = sp[-2]; \
+		const Value& b = sp[-1]; \
+		bool res = a.IsFloat() || b.IsFloat() ? a.ToFloat() op b.ToFloat() : a.nValue op b.nValue; \
+		sp[-2] = Value::MakeInt(res); \
+		--sp; \
+	}
+
+#ifdef CLARA_VM_COMPUTED_GOTO
+	static const void* const dispatch[] = {
+		&&L_INSN_NOP, &&L_INSN_BREAK, &&L_INSN_THROW,
+		&&L_INSN_PUSHN, &&L_INSN_PUSHB, &&L_INSN_PUSHW, &&L_INSN_PUSHD, &&L_INSN_PUSHF,
+		&&L_INSN_PUSHAB, &&L_INSN_PUSHAW, &&L_INSN_PUSHAD, &&L_INSN_PUSHAF, &&L_INSN_PUSHS,
+		&&L_INSN_POP, &&L_INSN_POPLN, &&L_INSN_POPL, &&L_INSN_POPLE, &&L_INSN_POPV, &&L_INSN_POPVE,
+		&&L_INSN_SWAP, &&L_INSN_DUP, &&L_INSN_DUPE,
+		&&L_INSN_LOCAL, &&L_INSN_GLOBAL, &&L_INSN_ARRAY,
+		&&L_INSN_EXF, &&L_INSN_INC, &&L_INSN_DEC, &&L_INSN_ADD, &&L_INSN_SUB, &&L_INSN_MUL, &&L_INSN_DIV, &&L_INSN_MOD,
+		&&L_INSN_AND, &&L_INSN_OR, &&L_INSN_XOR, &&L_INSN_SHL, &&L_INSN_SHR,
+		&&L_INSN_NEG, &&L_INSN_NOT,
+		&&L_INSN_TOI, &&L_INSN_TOF,
+		&&L_INSN_CMPNN, &&L_INSN_CMPE, &&L_INSN_CMPNE, &&L_INSN_CMPGE, &&L_INSN_CMPLE, &&L_INSN_CMPG, &&L_INSN_CMPL,
+		&&L_INSN_IF, &&L_INSN_EVAL,
+		&&L_INSN_JT, &&L_INSN_JNT, &&L_INSN_JMP, &&L_INSN_JMPA, &&L_INSN_SWITCH, &&L_INSN_RSWITCH,
+		&&L_INSN_CALL, &&L_INSN_CALLA, &&L_INSN_ENTER, &&L_INSN_RET,
+		&&L_INSN_JTB, &&L_INSN_JTW, &&L_INSN_JNTB, &&L_INSN_JNTW, &&L_INSN_JMPB, &&L_INSN_JMPW,
+		&&L_INSN_CASE,
+		&&L_END, &&L_INVALID,
+	};
+	static_assert(sizeof(dispatch) / sizeof(*dispatch) == NUM_CELL_HANDLERS, "every instruction needs a handler");
+
+	if (handlers) {
+		*handlers = dispatch;
+		return m_status;
+	}
+	JIT_ENTER();
+
+	#define VM_CASE(insn) L_##insn
+	#define VM_NEXT() do { \
+			if (TDecoded) { \
+				cell = cp++; \
+				PROFILE(CELL_INSN()); \
+				goto *cell->handler; \
+			} \
+			insn = ip; \
+			if (ip == codeEnd) goto L_END; \
+			uint8_t op_ = *ip++; \
+			PROFILE(op_); \
+			if (TChecked && op_ >= MAX_INSN) goto L_INVALID; \
+			goto *dispatch[op_]; \
+		} while (0)
+
+	VM_NEXT();
+#else
+	if (handlers) {
+		*handlers = nullptr;
+		return m_status;
+	}
+	JIT_ENTER();
+
+	#define VM_CASE(insn) case insn
+	#define VM_NEXT() continue
+
+	for (;;) {
+		uintptr_t op_;
+		if (TDecoded) {
+			cell = cp++;
+			op_ = cell->index;
+		}
+		else {
+			insn = ip;
+			if (ip == codeEnd) goto L_END;
+			op_ = *ip++;
+			if (TChecked && op_ >= MAX_INSN) goto L_INVALID;
+		}
+		PROFILE(op_);
+
+		switch (op_) {
+		case CELL_END:
+			goto L_END;
+		default:
+			goto L_INVALID;
+#endif
+	VM_CASE(INSN_NOP):
+		VM_NEXT();
+	VM_CASE(INSN_BREAK):
+		SAVE();
+		return m_status = VM_BREAK;
+	VM_CASE(INSN_THROW):
+		m_throwCode = IMM8();
+		m_status = VM_THROWN;
+		FAIL(VM_THROWN);
+
+	VM_CASE(INSN_PUSHN):
+		ROOM(1);
+		*sp++ = Value::MakeNull();
+		VM_NEXT();
+	VM_CASE(INSN_PUSHB):
+		ROOM(1);
+		*sp++ = Value::MakeInt(IMM8());
+		VM_NEXT();
+	VM_CASE(INSN_PUSHW):
+		ROOM(1);
+		*sp++ = Value::MakeInt(IMM16());
+		VM_NEXT();
+	VM_CASE(INSN_PUSHD):
+		ROOM(1);
+		*sp++ = Value::MakeInt(IMM32());
+		VM_NEXT();
+	VM_CASE(INSN_PUSHF):
+		ROOM(1);
+		*sp++ = Value::Make(Float, IMM32());
+		VM_NEXT();
+	VM_CASE(INSN_PUSHAB):
+		NEED(1);
+		sp[-1] = Value::MakeInt(static_cast<int8_t>(sp[-1].ToInt()));
+		VM_NEXT();
+	VM_CASE(INSN_PUSHAW):
+		NEED(1);
+		sp[-1] = Value::MakeInt(static_cast<int16_t>(sp[-1].ToInt()));
+		VM_NEXT();
+	VM_CASE(INSN_PUSHAD):
+		NEED(1);
+		sp[-1] = Value::MakeInt(sp[-1].ToInt());
+		VM_NEXT();
+	VM_CASE(INSN_PUSHAF):
+		NEED(1);
+		sp[-1] = Value::MakeFloat(sp[-1].ToFloat());
+		VM_NEXT();
+	VM_CASE(INSN_PUSHS):
+		ROOM(1);
+		*sp++ = Value::Make(String, IMM32());
+		VM_NEXT();
+
+	VM_CASE(INSN_POP):
+		{
+			uint8_t n = UIMM8();
+			NEED(n);
+			sp -= n;
+		}
+		VM_NEXT();
+	VM_CASE(INSN_POPLN):
+		{
+			uint8_t n = UIMM8();
+			auto& frame = m_frames.back();
+			if (n >= frame.numLocals) FAIL(VM_ERROR_BAD_LOCAL);
+			NEED(1);
+			stack[frame.locals + n] = *--sp;
+		}
+		VM_NEXT();
+	VM_CASE(INSN_POPL):
+		{
+			uint16_t n = UIMM16();
+			GLOBAL(n);
+			NEED(1);
+			globals[n] = *--sp;
+		}
+		VM_NEXT();
+	VM_CASE(INSN_POPLE):
+		{
+			uint32_t n = UIMM32();
+			GLOBAL(n);
+			NEED(1);
+			globals[n] = *--sp;
+		}
+		VM_NEXT();
+	VM_CASE(INSN_POPV):
+		{
+			uint16_t n = UIMM16();
+			GLOBAL(n);
+			NEED(1);
+			globals[n] = sp[-1];
+		}
+		VM_NEXT();
+	VM_CASE(INSN_POPVE):
+		{
+			uint32_t n = UIMM32();
+			GLOBAL(n);
+			NEED(1);
+			globals[n] = sp[-1];
+		}
+		VM_NEXT();
+	VM_CASE(INSN_SWAP):
+		NEED(2);
+		std::swap(sp[-1], sp[-2]);
+		VM_NEXT();
+	VM_CASE(INSN_DUP):
+		NEED(1);
+		ROOM(1);
+		sp[0] = sp[-1];
+		++sp;
+		VM_NEXT();
+	VM_CASE(INSN_DUPE):
+		{
+			uint8_t n = UIMM8();
+			NEED(n);
+			ROOM(n);
+			std::copy(sp - n, sp, sp);
+			sp += n;
+		}
+		VM_NEXT();
+
+	VM_CASE(INSN_LOCAL):
+		{
+			NEED(1);
+			auto& frame = m_frames.back();
+			auto n = static_cast<uint32_t>(sp[-1].ToInt());
+			if (n >= frame.numLocals) FAIL(VM_ERROR_BAD_LOCAL);
+			sp[-1] = stack[frame.locals + n];
+		}
+		VM_NEXT();
+	VM_CASE(INSN_GLOBAL):
+		{
+			NEED(1);
+			auto n = static_cast<uint32_t>(sp[-1].ToInt());
+			if (n >= numGlobals) FAIL(VM_ERROR_BAD_GLOBAL);
+			sp[-1] = globals[n];
+		}
+		VM_NEXT();
+	VM_CASE(INSN_ARRAY):
+		{
+			uint8_t n = UIMM8();
+			NEED(2);
+			int32_t index = sp[-1].ToInt();
+			--sp;
+			sp[-1] = Value::MakeInt(static_cast<int32_t>(static_cast<uint32_t>(sp[-1].ToInt()) + static_cast<uint32_t>(index) * n));
+		}
+		VM_NEXT();
+
+	VM_CASE(INSN_EXF):
+		{
+			NEED(1);
+			int32_t id = (--sp)->ToInt();
+			if (!m_external) FAIL(VM_ERROR_EXTERNAL);
+
+			// the handler works on the stack through the public interface
+			SAVE();
+			bool ok = m_external(*this, id, m_externalData);
+			LOAD();
+			if (!ok) FAIL(VM_ERROR_EXTERNAL);
+			// once it has moved the stack the verified depths no longer hold
+			if (!TChecked && !m_unchecked) return Run();
+		}
+		VM_NEXT();
+	VM_CASE(INSN_INC):
+		NEED(1);
+		if (sp[-1].IsFloat()) sp[-1].fValue += 1.0f;
+		else sp[-1] = Value::MakeInt(static_cast<int32_t>(static_cast<uint32_t>(sp[-1].nValue) + 1));
+		VM_NEXT();
+	VM_CASE(INSN_DEC):
+		NEED(1);
+		if (sp[-1].IsFloat()) sp[-1].fValue -= 1.0f;
+		else sp[-1] = Value::MakeInt(static_cast<int32_t>(static_cast<uint32_t>(sp[-1].nValue) - 1));
+		VM_NEXT();
+	VM_CASE(INSN_ADD):
+		BINARY_ARITH(+);
+		VM_NEXT();
+	VM_CASE(INSN_SUB):
+		BINARY_ARITH(-);
+		VM_NEXT();
+	VM_CASE(INSN_MUL):
+		BINARY_ARITH(*);
+		VM_NEXT();
+	VM_CASE(INSN_DIV):
+		{
+			NEED(2);
+			Value& a = sp[-2];
+			const Value& b = sp[-1];
+			if (a.IsFloat() || b.IsFloat()) a = Value::MakeFloat(a.ToFloat() / b.ToFloat());
+			else {
+				if (!b.nValue) FAIL(VM_ERROR_DIVIDE_BY_ZERO);
+				a = Value::MakeInt(b.nValue == -1 ? static_cast<int32_t>(0u - static_cast<uint32_t>(a.nValue)) : a.nValue / b.nValue);
+			}
+			--sp;
+		}
+		VM_NEXT();
+	VM_CASE(INSN_MOD):
+		{
+			NEED(2);
+			Value& a = sp[-2];
+			const Value& b = sp[-1];
+			if (a.IsFloat() || b.IsFloat()) a = Value::MakeFloat(fmodf(a.ToFloat(), b.ToFloat()));
+			else {
+				if (!b.nValue) FAIL(VM_ERROR_DIVIDE_BY_ZERO);
+				a = Value::MakeInt(b.nValue == -1 ? 0 : a.nValue % b.nValue);
+			}
+			--sp;
+		}
+		VM_NEXT();
+	VM_CASE(INSN_AND):
+		BINARY_BITWISE(l & r);
+		VM_NEXT();
+	VM_CASE(INSN_OR):
+		BINARY_BITWISE(l | r);
+		VM_NEXT();
+	VM_CASE(INSN_XOR):
+		BINARY_BITWISE(l ^ r);
+		VM_NEXT();
+	VM_CASE(INSN_SHL):
+		BINARY_BITWISE(static_cast<int32_t>(static_cast<uint32_t>(l) << (r & 31)));
+		VM_NEXT();
+	VM_CASE(INSN_SHR):
+		BINARY_BITWISE(l >> (r & 31));
+		VM_NEXT();
+	VM_CASE(INSN_NEG):
+		NEED(1);
+		if (sp[-1].IsFloat()) sp[-1].fValue = -sp[-1].fValue;
+		else sp[-1] = Value::MakeInt(static_cast<int32_t>(0u - static_cast<uint32_t>(sp[-1].nValue)));
+		VM_NEXT();
+	VM_CASE(INSN_NOT):
+		NEED(1);
+		sp[-1] = Value::MakeInt(~sp[-1].ToInt());
+		VM_NEXT();
+	VM_CASE(INSN_TOI):
+		NEED(1);
+		sp[-1] = Value::MakeInt(sp[-1].ToInt());
+		VM_NEXT();
+	VM_CASE(INSN_TOF):
+		NEED(1);
+		sp[-1] = Value::MakeFloat(sp[-1].ToFloat());
+		VM_NEXT();
+
+	VM_CASE(INSN_CMPNN):
+		NEED(1);
+		sp[-1] = Value::MakeInt(!sp[-1].IsNull());
+		VM_NEXT();
+	VM_CASE(INSN_CMPE):
+		COMPARE(==);
+		VM_NEXT();
+	VM_CASE(INSN_CMPNE):
+		COMPARE(!=);
+		VM_NEXT();
+	VM_CASE(INSN_CMPGE):
+		COMPARE(>=);
+		VM_NEXT();
+	VM_CASE(INSN_CMPLE):
+		COMPARE(<=);
+		VM_NEXT();
+	VM_CASE(INSN_CMPG):
+		COMPARE(>);
+		VM_NEXT();
+	VM_CASE(INSN_CMPL):
+		COMPARE(<);
+		VM_NEXT();
+	VM_CASE(INSN_IF):
+		NEED(1);
+		if (!(--sp)->IsTrue()) {
+			// skipping the last instruction leaves us at the end
+			if (TDecoded) cp += cp != lastCell;
+			else if (ip != codeEnd) ip += sizes[*ip];
+		}
+		VM_NEXT();
+	VM_CASE(INSN_EVAL):
+		{
+			uint8_t n = UIMM8();
+			NEED(n);
+			bool res = true;
+			for (uint8_t i = 0; i < n; ++i)
+				res &= (--sp)->IsTrue();
+			ROOM(1);
+			*sp++ = Value::MakeInt(res);
+		}
+		VM_NEXT();
+
+	VM_CASE(INSN_JT):
+		{
+			uint32_t target = TARGET();
+			NEED(1);
+			if ((--sp)->IsTrue()) JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JNT):
+		{
+			uint32_t target = TARGET();
+			NEED(1);
+			if (!(--sp)->IsTrue()) JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JMP):
+		{
+			NEED(1);
+			--sp;
+			uint32_t target = OFFSET_TARGET(static_cast<uint32_t>(sp->ToInt()));
+			CHECK_COMPUTED_TARGET(target);
+			JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JMPA):
+		JUMP(TARGET());
+		VM_NEXT();
+	VM_CASE(INSN_JTB):
+		{
+			uint32_t target = SHORT_TARGET8();
+			NEED(1);
+			if ((--sp)->IsTrue()) JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JTW):
+		{
+			uint32_t target = SHORT_TARGET16();
+			NEED(1);
+			if ((--sp)->IsTrue()) JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JNTB):
+		{
+			uint32_t target = SHORT_TARGET8();
+			NEED(1);
+			if (!(--sp)->IsTrue()) JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JNTW):
+		{
+			uint32_t target = SHORT_TARGET16();
+			NEED(1);
+			if (!(--sp)->IsTrue()) JUMP(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_JMPB):
+		JUMP(SHORT_TARGET8());
+		VM_NEXT();
+	VM_CASE(INSN_JMPW):
+		JUMP(SHORT_TARGET16());
+		VM_NEXT();
+	VM_CASE(INSN_SWITCH):
+	VM_CASE(INSN_RSWITCH):
+		{
+			// the table follows the switch - decoded code has the targets as cells already, and checked the table
+			const uint8_t* at = TDecoded ? code + m_decoded->offsets[cell - cells] : insn;
+			uint32_t count = Read16(at + 1);
+			const uint8_t* table = at + sizes[*at];
+			if (TChecked && static_cast<size_t>(codeEnd - table) / sizes[INSN_CASE] < count) FAIL(VM_ERROR_INVALID_INSTRUCTION);
+			NEED(1);
+			int32_t i = FindCase(table, sizes[INSN_CASE], count, (--sp)->ToInt(), *at == INSN_RSWITCH);
+			uint32_t target;
+			if (TDecoded) target = i < 0 ? cell->dwOperand : cell[1 + i].dwOperand;
+			else target = Read32(i < 0 ? at + 3 : table + i * sizes[INSN_CASE] + 5);
+			JUMP(target);
+		}
+		VM_NEXT();
+	// table entries are only read by their switch
+	VM_CASE(INSN_CASE):
+		FAIL(VM_ERROR_INVALID_INSTRUCTION);
+
+	VM_CASE(INSN_CALL):
+		{
+			NEED(1);
+			--sp;
+			uint32_t target = OFFSET_TARGET(static_cast<uint32_t>(sp->ToInt()));
+			CHECK_COMPUTED_TARGET(target);
+			CALL(target);
+		}
+		VM_NEXT();
+	VM_CASE(INSN_CALLA):
+		CALL(TARGET());
+		VM_NEXT();
+	VM_CASE(INSN_ENTER):
+		{
+			uint8_t n = UIMM8();
+			ROOM(n);
+			auto& frame = m_frames.back();
+			frame.locals = static_cast<uint32_t>(sp - stack);
+			frame.numLocals = n;
+			std::fill(sp, sp + n, Value::MakeNull());
+			sp += n;
+		}
+		VM_NEXT();
+	// running off the end of the code returns
+	L_END:
+	VM_CASE(INSN_RET):
+		{
+			if (m_frames.size() == 1) {
+				SAVE();
+				return m_status = VM_DONE;
+			}
+
+			auto frame = m_frames.back();
+			m_frames.pop_back();
+
+			// anything above the locals is the result
+			bool result = sp > stack + frame.locals + frame.numLocals;
+			Value value = result ? sp[-1] : Value();
+			sp = stack + frame.base;
+			if (result) *sp++ = value;
+			SET_POS(frame.returnPos);
+			JIT_ENTER();
+		}
+		VM_NEXT();
+
+#ifndef CLARA_VM_COMPUTED_GOTO
+		}
+	}
+#endif
+
+L_INVALID:
+	FAIL(VM_ERROR_INVALID_INSTRUCTION);
+
+#undef OFFSET
+#undef POS
+#undef SET_POS
+#undef ERROR_OFFSET
+#undef SAVE
+#undef LOAD
+#undef FAIL
+#undef NEED
+#undef ROOM
+#undef IMM8
+#undef UIMM8
+#undef IMM16
+#undef UIMM16
+#undef IMM32
+#undef UIMM32
+#undef TARGET
+#undef SHORT_TARGET8
+#undef SHORT_TARGET16
+#undef OFFSET_TARGET
+#undef POS_OFFSET
+#undef OFFSET_POS
+#undef JIT_ENTER
+#undef CURRENT_POS
+#undef BAD_TARGET
+#undef CHECK_TARGET
+#undef CHECK_COMPUTED_TARGET
+#undef JUMP
+#undef CALL
+#undef GLOBAL
+#undef PROFILE
+#undef CELL_INSN
+#undef BINARY_ARITH
+#undef BINARY_BITWISE
+#undef COMPARE
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+template VM_STATUS VM::Execute<false, true>(const void* const**);
+template VM_STATUS VM::Execute<true, true>(const void* const**);
+template VM_STATUS VM::Execute<false, false>(const void* const**);
+template VM_STATUS VM::Execute<true, false>(const void* const**);
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,196 @@
+#pragma once
+#include <stdint.h>
+#include <memory>
+#include <vector>
+#include <CLARA/CLARA.h>
+#include <CLARA/File.h>
+#include "Image.h"
+#include "Value.h"
+
+// The stack size used when a script's header doesn't give one, in values
+#define CLARA_VM_DEFAULT_STACK_SIZE 256
+// Times a function has to be called (or a loop branched back to) before the JIT compiles it
+#define CLARA_VM_JIT_THRESHOLD 16
+// Define CLARA_VM_PROFILE to count and time the instructions the interpreter runs, see GetProfile() - it also leaves
+// everything to the interpreter
+
+CLARA_NAMESPACE_BEGIN
+
+class JIT;
+class Profile;
+
+enum VM_STATUS {
+	VM_READY,					// loaded and waiting to run
+	VM_DONE,					// the script returned from its top level
+	VM_BREAK,					// stopped at a 'break' - Run() again to continue
+	VM_THROWN,					// the script executed 'throw', see GetThrowCode()
+	VM_ERROR_NOT_LOADED,
+	VM_ERROR_INVALID_INSTRUCTION,
+	VM_ERROR_UNSUPPORTED,		// instruction the VM can't execute yet
+	VM_ERROR_STACK_OVERFLOW,
+	VM_ERROR_STACK_UNDERFLOW,
+	VM_ERROR_BAD_GLOBAL,
+	VM_ERROR_BAD_LOCAL,
+	VM_ERROR_BAD_JUMP,
+	VM_ERROR_DIVIDE_BY_ZERO,
+	VM_ERROR_EXTERNAL,			// the 'exf' handler failed or there isn't one
+};
+
+// Interpreter for compiled CLARA scripts
+//
+// Values are tagged Value cells. Code offsets used by branches are relative to the start of the code
+// (the byte following the FileHeader). The stack and globals are allocated up front from the header.
+//
+// Instruction semantics, where 'a' is the value below the top 'b':
+//	pushn/b/w/d/f/s		push null, a sign-extended integer, a float, or a string index
+//	pushab/aw/ad/af		convert the top value to an 8/16/32-bit integer or a float
+//	pop N				pop N values
+//	popln N				pop into local N			popl/pople N	pop into global N
+//	popv/popve N		store the top value in global N without popping it
+//	swap, dup			swap the top two values, duplicate the top one
+//	dupe N				duplicate the top N values
+//	local, global		pop an index, push that local/global
+//	array N				pop an index and a base, push base + index * N
+//	exf					pop a function ID and pass it to the external function handler
+//	inc ... not			arithmetic and bitwise operations on a (and b) - the result is a float if either is
+//	toi, tof			convert the top value to an integer/float
+//	cmpnn				pop a value, push 1 if it wasn't null
+//	cmpe ... cmpl		pop b and a, push 1 if the comparison holds, else 0
+//	if					pop a condition, skip the next instruction if it's false
+//	eval N				pop N conditions, push 1 if all are true
+//	jt/jnt X			pop a condition, jump to X if it's true/false
+//	jmp, jmpa X			jump to a popped offset, or to X
+//	jtb/jtw/jntb/jntw D	jt/jnt with an 8/16-bit displacement from the next instruction
+//	jmpb/jmpw D			jump by an 8/16-bit displacement from the next instruction
+//	sw/rsw N, D			pop a value and jump to the target of its entry in the table of N 'case key, target'
+//						instructions which follows, or to D if there isn't one - sw needs an exact match, found
+//						directly when the keys are consecutive, rsw takes the last entry at or below the value
+//	case K, X			entry of a switch table - it's an invalid instruction to run one
+//	call, calla X		call a popped offset, or X
+//	enter N				reserve N locals (null) for the current function
+//	ret					return to the caller, keeping the top value as the result if there is one
+//						returning from the top level ends the script
+class VM {
+public:
+	// Handler for 'exf' - returns false to stop the script with VM_ERROR_EXTERNAL
+	typedef bool(*ExternalHandler)(VM& vm, int32_t id, void* userdata);
+
+	// Positions (the pc and return addresses) are code offsets, or cell indexes when running predecoded code
+	struct Frame {
+		uint32_t returnPos;
+		uint32_t base;				// stack depth at the call, restored on return
+		uint32_t locals;			// stack index of the first local
+		uint32_t numLocals;
+	};
+
+private:
+	std::shared_ptr<const Image> m_image;
+
+	std::vector<Value> m_stack;
+	std::vector<Value> m_globals;
+	std::vector<Frame> m_frames;
+	size_t m_sp = 0;				// number of values on the stack
+	uint32_t m_pc = 0;
+	bool m_predecode = false;
+	const DecodedCode* m_decoded = nullptr;		// set while running predecoded code
+	bool m_decodedUnchecked = false;			// whether m_decoded has the unchecked interpreter's handlers
+	bool m_verify = true;
+	bool m_unchecked = false;					// the image passed verification and nothing has moved the stack since
+	uint32_t m_jitThreshold = 0;
+	std::unique_ptr<JIT> m_jit;
+	std::unique_ptr<Profile> m_profile;			// only in profiling builds
+
+	VM_STATUS m_status = VM_ERROR_NOT_LOADED;
+	uint32_t m_errorOffset = 0;
+	int32_t m_throwCode = 0;
+
+	ExternalHandler m_external = nullptr;
+	void* m_externalData = nullptr;
+
+	VM_STATUS Fail(VM_STATUS status, uint32_t offset) {
+		m_errorOffset = offset;
+		return m_status = status;
+	}
+
+	// The interpreter - runs the raw bytecode, or the image's predecoded cells
+	// Passing 'handlers' just fetches the dispatch table the cells are decoded with
+	// Without TChecked it leaves out the checks the verifier has already made - the stack depth, static branch
+	// targets and global indexes, and the opcodes themselves - so it must only run verified images
+	template<bool TDecoded, bool TChecked>
+	VM_STATUS Execute(const void* const** handlers = nullptr);
+	// Points m_decoded at the cells for the interpreter Run() will use
+	void Predecode();
+
+public:
+	VM();
+	VM(const VM&) = delete;
+	VM& operator=(const VM&) = delete;
+	~VM();
+
+	// Loads a compiled script - returns false if it isn't a valid one
+	// Images are read-only, so one can be shared by any number of VMs
+	bool Load(std::shared_ptr<const Image> image);
+	bool Load(const char* path);
+	bool Load(const void* image, size_t size);
+	// Puts the script back to its initial state
+	void Reset();
+
+	// Runs the code from cells decoded when the script is loaded (or reset), rather than from the bytecode
+	// The decoding is done once per image and shared by the VMs using it
+	inline void SetPredecode(bool enable) { m_predecode = enable; }
+	// Compiles code to native code once it has been entered 'threshold' times, or 0 to only interpret
+	// Takes effect on Load() - returns false if there's no JIT for this platform
+	bool SetJitThreshold(uint32_t threshold = CLARA_VM_JIT_THRESHOLD);
+	// Verifies scripts as they're loaded, and runs those which pass without the runtime checks (the default)
+	// Hosts moving the stack with Push() or Pop() switch the rest of the run back to the checked interpreter
+	// Takes effect on Load() or Reset()
+	inline void SetVerify(bool enable) { m_verify = enable; }
+	// Whether the script is running without the runtime checks
+	inline bool IsUnchecked() const { return m_unchecked; }
+	// Instructions run since the VM was created or the profile was cleared, across scripts - null unless the VM was
+	// built with CLARA_VM_PROFILE
+	inline Profile* GetProfile() { return m_profile.get(); }
+
+	// Runs until the script ends, breaks or fails - once it has ended or failed, Reset() before running it again
+	VM_STATUS Run();
+
+	inline VM_STATUS GetStatus() const { return m_status; }
+	// Offset in the code of the instruction which failed
+	inline uint32_t GetErrorOffset() const { return m_errorOffset; }
+	inline int32_t GetThrowCode() const { return m_throwCode; }
+	inline const FileHeader& GetHeader() const { return m_image->GetHeader(); }
+	inline const std::shared_ptr<const Image>& GetImage() const { return m_image; }
+
+	void SetExternalHandler(ExternalHandler func, void* userdata = nullptr) {
+		m_external = func;
+		m_externalData = userdata;
+	}
+
+	// Stack access for hosts, e.g. from the external function handler
+	inline size_t GetStackDepth() const { return m_sp; }
+	inline Value& Top(size_t depth = 0) { return m_stack[m_sp - 1 - depth]; }
+	inline bool Push(const Value& v) {
+		if (m_sp == m_stack.size()) return false;
+		m_stack[m_sp++] = v;
+		m_unchecked = false;
+		return true;
+	}
+	inline bool Pop(Value& v) {
+		if (!m_sp) return false;
+		v = m_stack[--m_sp];
+		m_unchecked = false;
+		return true;
+	}
+
+	// Text of a string value - pushs gives the index of one in the image's table
+	inline std::string_view GetString(const Value& v) const {
+		return v.IsString() ? m_image->GetString(v.dwValue) : std::string_view();
+	}
+
+	inline size_t GetNumGlobals() const { return m_globals.size(); }
+	inline Value& GetGlobal(size_t index) { return m_globals[index]; }
+};
+
+const char* GetStatusName(VM_STATUS status);
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <CLARA/CLARA.h>
+#include <CLARA/Types.h>
+
+CLARA_NAMESPACE_BEGIN
+
+// A cell of the VM stack or globals segment - a BasicType tag and a 32-bit payload
+struct Value {
+	uint32_t type;
+	union {
+		int32_t nValue;
+		uint32_t dwValue;
+		float fValue;
+	};
+
+	static inline Value Make(BasicType type, int32_t v) {
+		Value val;
+		val.type = type;
+		val.nValue = v;
+		return val;
+	}
+	static inline Value MakeNull() { return Make(Null, 0); }
+	static inline Value MakeInt(int32_t v) { return Make(Integer, v); }
+	static inline Value MakeFloat(float v) {
+		Value val;
+		val.type = Float;
+		val.fValue = v;
+		return val;
+	}
+
+	inline BasicType GetType() const { return static_cast<BasicType>(type); }
+	inline bool IsNull() const { return type == Null; }
+	inline bool IsFloat() const { return type == Float; }
+	inline bool IsString() const { return type == String; }
+
+	// Conversions - null is zero, everything other than a float reads its payload as an integer
+	inline int32_t ToInt() const {
+		if (type != Float) return nValue;
+		// saturate rather than hit undefined behaviour on out of range floats (NaN is 0)
+		if (fValue >= 2147483647.0f) return INT32_MAX;
+		if (fValue <= -2147483648.0f) return INT32_MIN;
+		return fValue == fValue ? static_cast<int32_t>(fValue) : 0;
+	}
+	inline float ToFloat() const {
+		return type == Float ? fValue : static_cast<float>(nValue);
+	}
+	inline bool IsTrue() const {
+		return type == Float ? fValue != 0.0f : nValue != 0;
+	}
+};
+static_assert(sizeof(Value) == 8, "values should fit in two words");
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,102 @@
+#include "stdafx.h"
+#include <CLARA/Assembly.h>
+#include <CLARA/StackAnalysis.h>
+#include "Image.h"
+
+CLARA_NAMESPACE_BEGIN
+
+const char* GetVerifyResultName(VERIFY_RESULT result) {
+	switch (result) {
+	case VERIFY_OK: return "ok";
+	case VERIFY_INVALID_INSTRUCTION: return "invalid instruction";
+	case VERIFY_BAD_JUMP: return "branch target out of range";
+	case VERIFY_BAD_SWITCH: return "incomplete switch table";
+	case VERIFY_BAD_GLOBAL: return "global index out of range";
+	case VERIFY_UNBALANCED_STACK: return "unbalanced stack";
+	case VERIFY_STACK_UNDERFLOW: return "stack underflow";
+	case VERIFY_UNBOUNDED: return "stack depth can't be worked out";
+	}
+	return "unknown";
+}
+
+// Everything the VM would otherwise check as it runs, other than what depends on the values: local indexes
+// (which depend on the function's 'enter'), the 'local'/'global' instructions, division and computed branches
+void Image::Verify() const {
+	auto& v = m_verification;
+	auto fail = [&v](VERIFY_RESULT result, size_t offset) {
+		v.result = result;
+		v.offset = static_cast<uint32_t>(offset);
+	};
+
+	// the stack analysis works on instructions, so read them back with their operands as the compiler has them
+	auto sizes = GetInstructionSizes();
+	std::vector<CodeInstruction> code;
+	std::vector<uint32_t> offsets;
+	for (size_t offset = 0; offset < m_code.size; offset += sizes[m_code[offset]]) {
+		uint8_t op = m_code[offset];
+		if (op >= MAX_INSN || offset + sizes[op] > m_code.size)
+			return fail(VERIFY_INVALID_INSTRUCTION, offset);
+
+		CodeInstruction ci(static_cast<CLARA_INSTRUCTION>(op));
+		const uint8_t* p = m_code.data + offset + 1;
+		auto& params = g_Instructions[op].params;
+		for (size_t i = 0; i < params.size(); ++i) {
+			size_t width = GetImmSize(*params[i]);
+			for (size_t b = 0; b < width; ++b)
+				ci.operands[i] |= static_cast<uint32_t>(p[b]) << (b * 8);
+			p += width;
+
+			if ((*params[i] == Global16 || *params[i] == Global32) && ci.operands[i] >= m_header.NumGlobals)
+				return fail(VERIFY_BAD_GLOBAL, offset);
+		}
+		code.push_back(ci);
+		offsets.push_back(static_cast<uint32_t>(offset));
+	}
+	offsets.push_back(static_cast<uint32_t>(m_code.size));
+
+	auto& starts = GetInstructionMap();
+	auto lands = [&](uint32_t target) { return target <= m_code.size && starts[target]; };
+	for (size_t i = 0; i < code.size(); ++i) {
+		auto& ci = code[i];
+		bool ok = true;
+		switch (ci.insn) {
+		case INSN_JT: case INSN_JNT: case INSN_JMPA: case INSN_CALLA: case INSN_CASE:
+			ok = lands(ci.Target());
+			break;
+		// short branches are relative to the next instruction
+		case INSN_JTB: case INSN_JNTB: case INSN_JMPB:
+			ok = lands(offsets[i + 1] + static_cast<uint32_t>(static_cast<int8_t>(ci.operands[0])));
+			break;
+		case INSN_JTW: case INSN_JNTW: case INSN_JMPW:
+			ok = lands(offsets[i + 1] + static_cast<uint32_t>(static_cast<int16_t>(ci.operands[0])));
+			break;
+		case INSN_SWITCH: case INSN_RSWITCH:
+		{
+			size_t count = ci.operands[0];
+			if (i + count >= code.size()) return fail(VERIFY_BAD_SWITCH, offsets[i]);
+			for (size_t j = i + 1; j <= i + count; ++j) {
+				if (code[j].insn != INSN_CASE) return fail(VERIFY_BAD_SWITCH, offsets[i]);
+			}
+			ok = lands(ci.Target());
+			break;
+		}
+		default: break;
+		}
+		if (!ok) return fail(VERIFY_BAD_JUMP, offsets[i]);
+	}
+
+	StackAnalysis stack(code);
+	switch (stack.GetResult()) {
+	case STACK_OK:
+		v.stackSize = stack.GetStackSize();
+		break;
+	case STACK_UNBALANCED:
+		return fail(VERIFY_UNBALANCED_STACK, stack.GetOffset());
+	case STACK_UNDERFLOW:
+		return fail(VERIFY_STACK_UNDERFLOW, stack.GetOffset());
+	default:
+		return fail(VERIFY_UNBOUNDED, stack.GetOffset());
+	}
+}
+
+CLARA_NAMESPACE_END
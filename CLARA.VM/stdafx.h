@@ -0,0 +1,9 @@
+#pragma once
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <vector>
\ No newline at end of file
@@ -34,6 +34,40 @@ enum CLARA_ERROR {
 	// code errors
 	CLARA_ERROR_INVALID_DIRECTIVE,
 	CLARA_ERROR_INVALID_MNEMONIC,
+	CLARA_ERROR_UNDEFINED_LABEL,
+	CLARA_ERROR_DUPLICATE_LABEL,
+	CLARA_ERROR_INVALID_CASE,
+	CLARA_ERROR_DUPLICATE_CASE,
+	CLARA_ERROR_SWITCH_TOO_LARGE,
+	CLARA_ERROR_UNBALANCED_STACK,
+	CLARA_ERROR_STACK_UNDERFLOW,
+	CLARA_ERROR_DUPLICATE_STRING,
+	CLARA_ERROR_DUPLICATE_GLOBAL,
+
+	// new errors are added at the end, so the values of the others stay the same
+	CLARA_ERROR_ALLOCATION,		// the output allocator returned no memory
+	CLARA_ERROR_INVALID_ARGUMENT,	// a required argument was null
+	CLARA_ERROR_COMPILE_FAILED,	// the source had errors, which went to the error handler
+	CLARA_ERROR_INVALID_OPTION,	// unknown option passed to SetOption
+	CLARA_ERROR_INVALID_NUMBER,
+};
+enum CLARA_OPTION {
+	CLARA_OPTION_STREAMING,		// 1 to emit each line as soon as it has been parsed, keeping memory use flat (default 0) - the stack size is left to the VM, and globals keep their declared order
+	CLARA_OPTION_PEEPHOLE,		// CLARA_PEEPHOLE groups of rules to apply, -1 for all (default 0) - not in streaming mode
+	CLARA_OPTION_FOLD,			// 1 to fold operations on constants, and branches on them (default 0) - not in streaming mode
+	CLARA_OPTION_LONG_BRANCHES,	// 1 to keep every branch in its 32-bit absolute form rather than the shortest that fits (default 0)
+	CLARA_OPTION_MAP,			// 1 to write the layout of the globals to a .map file next to the output file (default 0)
+
+	MAX_OPTION,
+};
+// Groups of peephole rules, for CLARA_OPTION_PEEPHOLE
+enum CLARA_PEEPHOLE {
+	CLARA_PEEPHOLE_NOP = 1 << 0,		// remove nop
+	CLARA_PEEPHOLE_POP = 1 << 1,		// drop values pushed only to be popped, merge pops
+	CLARA_PEEPHOLE_SWAP = 1 << 2,		// remove swaps which make no difference, or swap the pushes instead
+	CLARA_PEEPHOLE_INC = 1 << 3,		// add/sub of 1 to inc/dec
+
+	CLARA_PEEPHOLE_ALL = -1,
 };
 enum CLARA_MNEMONIC {
 	CLARA_BAD_MNEMONIC = -1,
@@ -54,7 +88,9 @@ enum CLARA_MNEMONIC {
 	// branching
 	CLARA_JT, CLARA_JNT, CLARA_JMP, CLARA_SWITCH, CLARA_RSWITCH,
 	// functions
-	CLARA_CALL, CLARA_ENTER, CLARA_RET
+	CLARA_CALL, CLARA_ENTER, CLARA_RET,
+
+	MAX_MNEMONIC,
 };
 enum CLARA_INSTRUCTION : char {
 	INSN_INVALID = -1,
@@ -79,6 +115,10 @@ enum CLARA_INSTRUCTION : char {
 	INSN_JT, INSN_JNT, INSN_JMP, INSN_JMPA, INSN_SWITCH, INSN_RSWITCH,
 	// Functions
 	INSN_CALL, INSN_CALLA, INSN_ENTER, INSN_RET,
+	// Short Branches - relative to the next instruction, only chosen by the assembler
+	INSN_JTB, INSN_JTW, INSN_JNTB, INSN_JNTW, INSN_JMPB, INSN_JMPW,
+	// Switch Tables - an entry of the table following sw/rsw, only emitted by the assembler
+	INSN_CASE,
 
 	MAX_INSN,
 };
@@ -87,14 +127,42 @@ enum CLARA_OPCODE {
 };
 
 
+// Opaque handle to a compiler context - holds the handlers, options and scratch space used by a compile
+struct Context;
+typedef struct Context* CLARA_CONTEXT;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+	// Allocates 'size' bytes for the compiled bytecode - may return a caller-owned buffer, or null to abort
+	typedef void*(*CLARA_ALLOCATOR)(size_t size, void* userdata);
+
 	// CLARA.dll exports
+	// Compiles the file 'in' ("-" for stdin) into 'out' - nothing is left at 'out' if the source has errors, which returns CLARA_ERROR_COMPILE_FAILED
 	CLARA_ERROR Compile(const char* in, const char* out);
+	// Compiles source code in memory - the bytecode is copied into memory provided by 'alloc' and its size stored in 'outSize'
+	// Nothing is allocated if the source has errors, which returns CLARA_ERROR_COMPILE_FAILED
+	CLARA_ERROR CompileBuffer(const char* source, size_t size, CLARA_ALLOCATOR alloc, void* userdata, size_t* outSize);
 	CLARA_ERROR SetOutputHandler(bool(*func)(const char*));
+	// Passes a message to the output handler, e.g. a report from the VM - CLARA_ERROR_INTERRUPTED if the handler asks to stop
+	CLARA_ERROR Output(const char* msg);
 	CLARA_ERROR SetErrorHandler(bool(*func)(CLARA_ERROR, const char *));
+	CLARA_ERROR SetOption(CLARA_OPTION option, int value);
+	// Enables the compile cache - Compile() reuses the image of an identical earlier build from this directory (nullptr/"" to disable)
+	CLARA_ERROR SetCacheDirectory(const char* path);
+
+	// Context variants - the functions above all work on a single default context
+	// Calls with different contexts may run concurrently, each context may only be used by one thread at a time
+	CLARA_CONTEXT CreateContext();
+	void DestroyContext(CLARA_CONTEXT context);
+	CLARA_ERROR ContextSetOutputHandler(CLARA_CONTEXT context, bool(*func)(const char*, void* userdata), void* userdata);
+	CLARA_ERROR ContextOutput(CLARA_CONTEXT context, const char* msg);
+	CLARA_ERROR ContextSetErrorHandler(CLARA_CONTEXT context, bool(*func)(CLARA_ERROR, const char*, void* userdata), void* userdata);
+	CLARA_ERROR ContextSetOption(CLARA_CONTEXT context, CLARA_OPTION option, int value);
+	CLARA_ERROR ContextSetCacheDirectory(CLARA_CONTEXT context, const char* path);
+	CLARA_ERROR ContextCompile(CLARA_CONTEXT context, const char* in, const char* out);
+	CLARA_ERROR ContextCompileBuffer(CLARA_CONTEXT context, const char* source, size_t size, CLARA_ALLOCATOR alloc, void* userdata, size_t* outSize);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,61 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <type_traits>
+#include "CLARA.h"
+
+CLARA_NAMESPACE_BEGIN
+
+// Bump allocator for trivially copyable records - everything allocated from it is released in one go
+template<typename T, size_t BlockSize = 4096>
+class Arena {
+	static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value, "arena records must be trivial");
+
+	std::vector<std::unique_ptr<T[]>> m_blocks;
+	std::vector<std::unique_ptr<T[]>> m_large;	// allocations which don't fit in a block
+	size_t m_block = 0;							// index of the block being filled
+	size_t m_used = 0;							// number of records used in that block
+
+public:
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	T* Allocate(size_t n) {
+		if (n > BlockSize) {
+			m_large.emplace_back(new T[n]);
+			return m_large.back().get();
+		}
+		if (m_block == m_blocks.size() || m_used + n > BlockSize) {
+			if (m_block < m_blocks.size()) ++m_block;
+			if (m_block == m_blocks.size()) m_blocks.emplace_back(new T[BlockSize]);
+			m_used = 0;
+		}
+
+		T* ptr = &m_blocks[m_block][m_used];
+		m_used += n;
+		return ptr;
+	}
+
+	// Copies 'n' records into the arena
+	T* Copy(const T* src, size_t n) {
+		T* ptr = Allocate(n);
+		std::copy(src, src + n, ptr);
+		return ptr;
+	}
+
+	// Invalidates every allocation at once, keeping the blocks for reuse
+	void Reset() {
+		m_large.clear();
+		m_block = 0;
+		m_used = 0;
+	}
+	// Invalidates every allocation at once and frees the memory
+	void Release() {
+		m_blocks.clear();
+		Reset();
+	}
+};
+
+CLARA_NAMESPACE_END
@@ -1,8 +1,12 @@
 #pragma once
+#include <charconv>
 #include <vector>
 #include <sstream>
 #include <memory>
+#include <type_traits>
 #include "CLARA.h"
+#include "Arena.h"
+#include "Lexer.h"
 #include "Types.h"
 
 CLARA_NAMESPACE_BEGIN
@@ -19,18 +23,94 @@ struct InstructionType {
 	InstructionType(const char* nm, unsigned mp, std::vector<const ImmediateType*> vec, std::vector<std::string> defs) : name(nm), minParams(mp), params(vec), defaults(defs) { }
 };
 
+// Values an instruction pops and then pushes - STACK_N is its first operand, STACK_2N twice that
+enum : int8_t { STACK_N = -1, STACK_2N = -2 };
+struct StackEffect {
+	int8_t pops = 0;
+	int8_t pushes = 0;
+
+	static inline uint32_t Count(int8_t count, uint32_t operand) {
+		return count == STACK_N ? operand : count == STACK_2N ? 2 * operand : static_cast<uint32_t>(count);
+	}
+	inline uint32_t GetPops(uint32_t operand) const { return Count(pops, operand); }
+	inline uint32_t GetPushes(uint32_t operand) const { return Count(pushes, operand); }
+};
+
 typedef std::pair<CLARA_MNEMONIC, std::vector<CLARA_INSTRUCTION>> MnemonicInstruction;
 
 extern const InstructionType g_Instructions[MAX_INSN];
-extern const std::map<std::string, CLARA_MNEMONIC> g_Mnemonics;
+extern const StackEffect g_StackEffects[MAX_INSN];
 extern const std::vector<MnemonicInstruction> g_MnemonicVec;
 extern const std::vector<MnemonicInstruction> g_MnemonicVec2;
 extern const std::map<CLARA_INSTRUCTION, CLARA_MNEMONIC> g_Friends;
 
-const MnemonicInstruction* GetMnemonicInstruction(std::string);
+CLARA_MNEMONIC FindMnemonic(std::string_view);
+const MnemonicInstruction* GetMnemonicInstruction(std::string_view);
 const MnemonicInstruction* GetMnemonicInstruction(CLARA_MNEMONIC);
 size_t GetIntNumBytes(int32_t);
 size_t GetUIntNumBytes(uint32_t);
+// Encoded size of an instruction and its operands, in bytes
+size_t GetInstructionSize(CLARA_INSTRUCTION);
+
+enum NumberKind {
+	NUMBER_INVALID, NUMBER_INT, NUMBER_UINT, NUMBER_FLOAT,
+};
+// A classified numeric literal
+struct Number {
+	NumberKind kind = NUMBER_INVALID;
+	uint8_t size = 0;		// bytes needed by the smallest encoding
+	union {
+		int32_t nValue = 0;
+		uint32_t dwValue;
+		float fValue;
+	};
+};
+
+// Classifies a numeric literal in one pass without allocating or throwing
+// Handles decimal and '0x' hex integers, either optionally negative, and floats - integers up to INT32_MAX are signed
+inline Number ClassifyNumber(std::string_view text) {
+	Number num;
+	const char* begin = text.data();
+	const char* end = begin + text.size();
+	const char* digits = begin;
+	bool negative = digits != end && *digits == '-';
+	if (negative) ++digits;
+
+	int base = 10;
+	if (end - digits > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+		base = 16;
+		digits += 2;
+	}
+
+	uint64_t v;
+	auto res = std::from_chars(digits, end, v, base);
+	if (res.ec == std::errc() && res.ptr == end) {
+		if (negative ? v <= 0x80000000ull : v <= 0x7FFFFFFFull) {
+			num.kind = NUMBER_INT;
+			num.nValue = static_cast<int32_t>(negative ? -static_cast<int64_t>(v) : static_cast<int64_t>(v));
+			num.size = static_cast<uint8_t>(GetIntNumBytes(num.nValue));
+		}
+		else if (!negative && v <= 0xFFFFFFFFull) {
+			num.kind = NUMBER_UINT;
+			num.dwValue = static_cast<uint32_t>(v);
+			num.size = static_cast<uint8_t>(GetUIntNumBytes(num.dwValue));
+		}
+		if (num.kind != NUMBER_INVALID)
+			return num;
+	}
+
+	// anything else in decimal, including integers out of the 32-bit range, is taken as a float
+	if (base == 10) {
+		float f;
+		auto res = std::from_chars(begin, end, f);
+		if (res.ec == std::errc() && res.ptr == end) {
+			num.kind = NUMBER_FLOAT;
+			num.fValue = f;
+			num.size = sizeof(float);
+		}
+	}
+	return num;
+}
 
 enum ParamType {
 	PT_NULL,
@@ -41,16 +121,22 @@ enum ParamType {
 enum OperandType {
 	OP_INVALID, OP_IMMEDIATE, OP_INSTRUCTION,
 	OP_VARIABLE,
+	OP_LABEL,			// a label definition, on a line of its own
+	OP_REFERENCE,		// a label used as a branch target
+	OP_GLOBAL,			// a global by ID, which becomes its index once the globals are laid out
+};
+// Classes of operands distinguished by instruction selection
+enum OperandClass {
+	CLASS_IMM8, CLASS_IMM16, CLASS_IMM32, CLASS_FLOAT, CLASS_STRING,
+	NUM_OPERAND_CLASSES,
+	CLASS_INVALID = NUM_OPERAND_CLASSES,
 };
 
 class Mnemonic {
 	CLARA_MNEMONIC m_mnemonic;
 
 public:
-	Mnemonic(std::string mnemonic) {
-		auto it = g_Mnemonics.find(mnemonic);
-		m_mnemonic = it == g_Mnemonics.end() ? CLARA_BAD_MNEMONIC : it->second;
-	}
+	Mnemonic(std::string_view mnemonic) : m_mnemonic(FindMnemonic(mnemonic)) { }
 	Mnemonic(CLARA_MNEMONIC mn) : m_mnemonic(mn) { }
 
 	inline operator CLARA_MNEMONIC() const { return m_mnemonic; }
@@ -70,29 +156,28 @@ class Parameter {
 	};
 
 	void DetermineValue() {
-		if (!m_str.empty()) {
-			if (m_str.find('.') != m_str.npos) {
-				m_fValue = std::stof(m_str);
-				m_type = PT_FLOAT;
-			}
-			else {
-				bool sign = m_str.find('-') != m_str.npos;
-				if (sign)
-					m_nValue = std::stol(m_str, 0, 0);
-				else
-					m_dwValue = std::stoul(m_str, 0, 0);
-
-				if (sign) {
-					if (m_cValue == m_nValue) m_type = PT_CHAR;
-					else if (m_sValue == m_nValue) m_type = PT_SHORT;
-					else m_type = PT_INT;
-				}
-				else {
-					if (m_cValue == m_dwValue) m_type = PT_BYTE;
-					else if (m_cValue == m_dwValue) m_type = PT_WORD;
-					else m_type = PT_DWORD;
-				}
+		auto num = ClassifyNumber(m_str);
+		switch (num.kind) {
+		case NUMBER_FLOAT:
+			m_fValue = num.fValue;
+			m_type = PT_FLOAT;
+			break;
+		case NUMBER_INT:
+			if (num.nValue < 0) {
+				m_nValue = num.nValue;
+				m_type = num.size <= 1 ? PT_CHAR : num.size <= 2 ? PT_SHORT : PT_INT;
+				break;
 			}
+			// non-negative values are kept unsigned
+			[[fallthrough]];
+		case NUMBER_UINT:
+			m_dwValue = num.dwValue;
+			num.size = static_cast<uint8_t>(GetUIntNumBytes(m_dwValue));
+			m_type = num.size <= 1 ? PT_BYTE : num.size <= 2 ? PT_WORD : PT_DWORD;
+			break;
+		default:
+			m_type = PT_NULL;
+			break;
 		}
 	}
 
@@ -134,7 +219,7 @@ class Instruction {
 	}
 
 public:
-	Instruction(std::string mn) : m_mninsn(GetMnemonicInstruction(mn)), m_insn(INSN_INVALID) {
+	Instruction(std::string_view mn) : m_mninsn(GetMnemonicInstruction(mn)), m_insn(INSN_INVALID) {
 		Init();
 	}
 	Instruction(CLARA_INSTRUCTION insn) : m_mninsn(&g_MnemonicVec[insn]), m_insn(insn) {
@@ -230,84 +315,122 @@ public:
 	}
 };
 
-class BaseOperand {
-	OperandType m_opType;
+// Compact operand record - trivially copyable so that lines of them can live in the compiler's arena
+class Operand {
+	uint8_t m_type = OP_INVALID;	// OperandType
+	uint8_t m_size = 0;				// size of the encoded value in bytes
+	uint8_t m_kind = Null;			// BasicType of an immediate
+	uint8_t m_signed = 0;
+	union {
+		int32_t m_nValue;
+		uint32_t m_dwValue;
+		float m_fValue;
+	};
+
+	Operand(OperandType type, BasicType kind, size_t size, bool sign) : m_type(type), m_size(static_cast<uint8_t>(size)), m_kind(kind), m_signed(sign), m_dwValue(0) { }
 
 public:
-	BaseOperand(OperandType type) : m_opType(type) { }
-	virtual ~BaseOperand() { }
+	Operand() : m_dwValue(0) { }
 
-	inline OperandType GetType() const {
-		return m_opType;
+	template<typename T>
+	static Operand Imm(T val) {
+		static_assert(sizeof(T) <= 4, "immediates are at most 32 bits");
+		Operand op(OP_IMMEDIATE, std::is_floating_point<T>::value ? Float : Integer, sizeof(T), std::is_signed<T>::value);
+		if (std::is_floating_point<T>::value) op.m_fValue = static_cast<float>(val);
+		else if (std::is_signed<T>::value) op.m_nValue = static_cast<int32_t>(val);
+		else op.m_dwValue = static_cast<uint32_t>(val);
+		return op;
+	}
+	// A string by its index in the string pool
+	static Operand Str(uint32_t index) {
+		Operand op(OP_IMMEDIATE, String, sizeof(uint32_t), false);
+		op.m_dwValue = index;
+		return op;
+	}
+	static Operand Ins(CLARA_MNEMONIC mn) {
+		Operand op(OP_INSTRUCTION, Null, sizeof(CLARA_INSTRUCTION), false);
+		op.m_nValue = mn;
+		return op;
+	}
+	// A label definition (OP_LABEL) or reference (OP_REFERENCE) by ID
+	static Operand Label(OperandType type, uint32_t id) {
+		Operand op(type, Null, sizeof(uint32_t), false);
+		op.m_dwValue = id;
+		return op;
+	}
+	// A global by its declaration ID
+	static Operand Glob(uint32_t id) {
+		Operand op(OP_GLOBAL, BasicType::Global, sizeof(uint32_t), false);
+		op.m_dwValue = id;
+		return op;
 	}
 
-	virtual size_t GetSize() const = 0;
-};
-
-template<typename T>
-class Imm : public BaseOperand {
-	T m_value;
-
-public:
-	template<typename TV>
-	Imm(TV val) : BaseOperand(OP_IMMEDIATE), m_value(static_cast<T>(val)) { }
+	inline OperandType GetType() const { return static_cast<OperandType>(m_type); }
+	inline BasicType GetKind() const { return static_cast<BasicType>(m_kind); }
+	inline size_t GetSize() const { return m_size; }
+	inline bool IsSigned() const { return m_signed != 0; }
+	inline bool IsFloat() const { return m_kind == Float; }
 
-	template<typename Ty>
-	inline bool IsType() const {
-		return typeid(Ty) == typeid(T);
-	}
 	template<typename Ty>
 	inline Ty GetValue() const {
-		assert(IsType<Ty>());
-		return m_value;
+		if (std::is_floating_point<Ty>::value) return static_cast<Ty>(m_fValue);
+		if (std::is_signed<Ty>::value) return static_cast<Ty>(m_nValue);
+		return static_cast<Ty>(m_dwValue);
 	}
-
-	virtual size_t GetSize() const override {
-		return sizeof(T);
+	// Raw little-endian bits of the value, as encoded in the bytecode
+	inline uint32_t GetBits() const { return m_dwValue; }
+
+	inline CLARA_MNEMONIC GetMnemonic() const { return static_cast<CLARA_MNEMONIC>(m_nValue); }
+	inline CLARA_INSTRUCTION GetInstruction() const { return INSN_INVALID; }
+	inline uint32_t GetLabel() const { return m_dwValue; }
+	inline uint32_t GetGlobal() const { return m_dwValue; }
+
+	inline OperandClass GetClass() const {
+		// references are resolved to 32-bit code offsets
+		if (m_type == OP_REFERENCE) return CLASS_IMM32;
+		if (m_type != OP_IMMEDIATE) return CLASS_INVALID;
+		if (m_kind == Float) return CLASS_FLOAT;
+		if (m_kind == String) return CLASS_STRING;
+		return m_size <= 1 ? CLASS_IMM8 : m_size <= 2 ? CLASS_IMM16 : CLASS_IMM32;
 	}
-};
-
-class Ins : public BaseOperand {
-	CLARA_INSTRUCTION m_instruction = INSN_INVALID;
-	CLARA_MNEMONIC m_mnemonic = CLARA_BAD_MNEMONIC;
-
-public:
-	Ins() : BaseOperand(OP_INSTRUCTION) { }
-	Ins(CLARA_MNEMONIC mn) : BaseOperand(OP_INSTRUCTION), m_mnemonic(mn) { }
 
-	inline CLARA_MNEMONIC GetMnemonic() const { return m_mnemonic; }
-	inline CLARA_INSTRUCTION GetInstruction() const { return m_instruction; }
-
-	virtual size_t GetSize() const override {
-		return sizeof(m_instruction);
-	}
+	inline bool Empty() const { return m_type == OP_INVALID; }
+	inline operator bool() const { return !Empty(); }
 };
+static_assert(std::is_trivially_copyable<Operand>::value, "operands must be trivially copyable");
 
-class Operand {
-	std::shared_ptr<BaseOperand> m_op;
+typedef Arena<Operand> OperandArena;
 
-public:
-	Operand() { }
-	Operand(BaseOperand* op) : m_op(op) { }
-	template<typename T>
-	Operand(std::shared_ptr<T> op) : m_op(op) { }
+// A parsed line of operands - the records are owned by the compiler's arena
+class Line {
+	const Operand* m_operands = nullptr;
+	size_t m_size = 0;
 
-	template<typename T>
-	Operand& operator=(std::shared_ptr<T> op) {
-		m_op = op;
-		return *this;
-	}
+public:
+	Line(const Operand* ops, size_t size) : m_operands(ops), m_size(size) { }
+
+	inline const Operand* begin() const { return m_operands; }
+	inline const Operand* end() const { return m_operands + m_size; }
+	inline const Operand& front() const { return m_operands[0]; }
+	inline const Operand& back() const { return m_operands[m_size - 1]; }
+	inline const Operand& operator[](size_t i) const { return m_operands[i]; }
+	inline size_t size() const { return m_size; }
+	inline bool empty() const { return m_size == 0; }
+};
 
-	template<typename Ty>
-	std::shared_ptr<Ty> Get() const {
-		return std::static_pointer_cast<Ty>(m_op);
-	}
-	std::shared_ptr<BaseOperand> GetBase() const {
-		return m_op;
-	}
+enum { MAX_SELECT_PARAMS = 2 };		// most parameters taken by any instruction
 
-	inline bool Empty() const { return m_op.get() == nullptr; }
-	inline operator bool() const { return !Empty(); }
+// Instruction chosen for a mnemonic and its operands, along with anything needed to encode it
+struct Selection {
+	CLARA_INSTRUCTION insn = INSN_INVALID;
+	CLARA_MNEMONIC friendMnemonic = CLARA_BAD_MNEMONIC;	// if set, every operand is first passed to this mnemonic
+	uint8_t numParams = 0;								// number of parameters encoded, including defaults
+	uint8_t numDefaults = 0;
+	uint8_t widths[MAX_SELECT_PARAMS] = {};				// encoded size of each parameter
+	Operand defaults[MAX_SELECT_PARAMS];				// pre-parsed default values for missing parameters
 };
 
+// Looks up the instruction for a mnemonic and its operands in the precomputed table - returns null if there is none
+const Selection* SelectInstruction(CLARA_MNEMONIC, const Operand* params, size_t numParams);
+
 CLARA_NAMESPACE_END
\ No newline at end of file
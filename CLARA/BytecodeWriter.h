@@ -0,0 +1,120 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <ostream>
+#include <vector>
+#include "CLARA.h"
+
+CLARA_NAMESPACE_BEGIN
+
+// Growable in-memory buffer the compiler emits bytecode into - values are always stored little-endian
+class BytecodeWriter {
+	std::vector<uint8_t> m_buffer;
+	std::ostream* m_sink = nullptr;
+	size_t m_syncSize = 0;
+	size_t m_flushed = 0;			// number of bytes already written out to the sink
+
+	inline uint8_t* Grow(size_t n) {
+		size_t pos = m_buffer.size();
+		m_buffer.resize(pos + n);
+		return &m_buffer[pos];
+	}
+
+public:
+	BytecodeWriter(size_t capacity = 4096) {
+		m_buffer.reserve(capacity);
+	}
+	// Writes out to 'sink' whenever Sync() finds 'syncSize' bytes buffered, so memory use stays flat
+	BytecodeWriter(std::ostream& sink, size_t syncSize = 0x10000) : m_sink(&sink), m_syncSize(syncSize) {
+		m_buffer.reserve(syncSize + 256);
+	}
+
+	inline void Put8(uint8_t v) {
+		m_buffer.push_back(v);
+	}
+	inline void Put16(uint16_t v) {
+		auto p = Grow(2);
+		p[0] = static_cast<uint8_t>(v);
+		p[1] = static_cast<uint8_t>(v >> 8);
+	}
+	inline void Put32(uint32_t v) {
+		auto p = Grow(4);
+		p[0] = static_cast<uint8_t>(v);
+		p[1] = static_cast<uint8_t>(v >> 8);
+		p[2] = static_cast<uint8_t>(v >> 16);
+		p[3] = static_cast<uint8_t>(v >> 24);
+	}
+	// Writes the low 'width' bytes of a value
+	inline void Put(uint32_t v, size_t width) {
+		switch (width) {
+		case 1: Put8(static_cast<uint8_t>(v)); break;
+		case 2: Put16(static_cast<uint16_t>(v)); break;
+		case 4: Put32(v); break;
+		}
+	}
+	inline void Put(const void* data, size_t size) {
+		if (size) memcpy(Grow(size), data, size);
+	}
+
+	// Reserves zeroed space to be patched later - returns its offset
+	inline size_t Reserve(size_t size) {
+		size_t pos = Size();
+		Grow(size);
+		return pos;
+	}
+	// Overwrites previously written bytes - those already written to the sink are patched by seeking back
+	bool Patch(size_t offset, const void* data, size_t size) {
+		auto bytes = static_cast<const char*>(data);
+		size_t written = offset < m_flushed ? std::min(size, m_flushed - offset) : 0;
+		if (written < size)
+			memcpy(&m_buffer[offset + written - m_flushed], bytes + written, size - written);
+		if (!written)
+			return true;
+
+		auto end = m_sink->tellp();
+		m_sink->seekp(offset);
+		m_sink->write(bytes, written);
+		m_sink->seekp(end);
+		return m_sink->good();
+	}
+	inline bool Patch32(size_t offset, uint32_t v) {
+		uint8_t bytes[4] = {static_cast<uint8_t>(v), static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v >> 16), static_cast<uint8_t>(v >> 24)};
+		return Patch(offset, bytes, 4);
+	}
+
+	// Total number of bytes written, including those already passed on to the sink
+	inline size_t Size() const { return m_flushed + m_buffer.size(); }
+	// Buffered bytes - the whole image unless a sink is in use
+	inline const uint8_t* Data() const { return m_buffer.data(); }
+
+	// Passes the buffered bytes on to the sink once enough have built up
+	inline void Sync() {
+		if (m_sink && m_buffer.size() >= m_syncSize)
+			Flush();
+	}
+	// Passes all buffered bytes on to the sink
+	bool Flush() {
+		if (!m_sink) return false;
+		Flush(*m_sink);
+		m_flushed += m_buffer.size();
+		m_buffer.clear();
+		return m_sink->good();
+	}
+
+	void Clear() {
+		m_buffer.clear();
+		m_flushed = 0;
+	}
+	// Writes the buffered image in one go
+	bool Flush(std::ostream& out) const {
+		out.write(reinterpret_cast<const char*>(m_buffer.data()), m_buffer.size());
+		return out.good();
+	}
+	// Hands the image over to the caller
+	std::vector<uint8_t> Release() {
+		return std::move(m_buffer);
+	}
+};
+
+CLARA_NAMESPACE_END
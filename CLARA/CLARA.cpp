@@ -1,25 +1,27 @@
 #include "stdafx.h"
 #include <cctype>
+#include <cstring>
 #include <vector>
 #include <fstream>
 #include <algorithm>
 #include <functional>
+#include <iterator>
+#include <string_view>
 #include "API.h"
 #include "CLARA.h"
+#include "Cache.h"
 #include "Compiler.h"
+#include "Context.h"
+#include "MappedFile.h"
+#include "Optimizer.h"
 #include "Types.h"
 
-#define MAX_BUFFER 64
-
 CLARA_NAMESPACE_BEGIN
 
-std::ifstream g_hInput;
-std::ifstream g_hOutput;
-int g_nNumInstructionsRead;
-int g_nNumOpcodesWritten;
-char g_Buffer[MAX_BUFFER];
-char* g_BufferCurrent = g_Buffer;
-const char* g_BufferEnd = &g_Buffer[MAX_BUFFER];
+// Context used by the functions which don't take one
+Context g_DefaultContext;
+bool(*g_Output)(const char*) = nullptr;
+bool(*g_Error)(CLARA_ERROR, const char*) = nullptr;
 
 const ImmediateType gImm8 = Imm8;
 const ImmediateType gImm16 = Imm16;
@@ -30,6 +32,7 @@ const ImmediateType gLocal32 = Local32;
 const ImmediateType gGlobal16 = Global16;
 const ImmediateType gGlobal32 = Global32;
 const ImmediateType gString32 = String32;
+const ImmediateType gFloat32 = Float32;
 
 // Information on instructions including their parameter types and default values
 // {name, minNumberOfParams, {[paramType1, paramType2...]}, {[defaultValue1, defaultValue2...]}}
@@ -41,9 +44,9 @@ const InstructionType g_Instructions[] = {
 	{"pushb", 1,{&gImm8}},
 	{"pushw", 1,{&gImm16}},
 	{"pushd", 1,{&gImm32}},
-	{"pushf", 1,{&gImm32}},
+	{"pushf", 1,{&gFloat32}},
 	{"pushab"},{"pushaw"},{"pushad"},{"pushaf"},
-	{"pushs", 1,{&gImm32}},
+	{"pushs", 1,{&gString32}},
 	{"pop", 0,{&gImm8},{"1"}},
 	{"popln", 1,{&gLocal8}},
 	{"popl", 1,{&gGlobal16}},
@@ -68,15 +71,64 @@ const InstructionType g_Instructions[] = {
 	{"jmp"},
 	{"jmpa", 1,{&gImm32}},
 	{"sw", 2,{&gImm16, &gImm32}},
-	{"rsw", 2},
+	{"rsw", 2,{&gImm16, &gImm32}},
 	{"call"},
 	{"calla", 1,{&gImm32}},
 	{"enter", 1,{&gImm8}},
-	{"ret"}
+	{"ret"},
+	{"jtb", 1,{&gImm8}},
+	{"jtw", 1,{&gImm16}},
+	{"jntb", 1,{&gImm8}},
+	{"jntw", 1,{&gImm16}},
+	{"jmpb", 1,{&gImm8}},
+	{"jmpw", 1,{&gImm16}},
+	{"case", 2,{&gImm32, &gImm32}}
+};
+
+// Stack effect of each instruction, in the same order - calls and returns are worked out by the stack analysis
+// {pops, pushes}
+const StackEffect g_StackEffects[] = {
+	{0, 0},							// nop
+	{0, 0},							// break
+	{0, 0},							// throw
+	{0, 1},{0, 1},{0, 1},{0, 1},{0, 1},	// pushn, pushb, pushw, pushd, pushf
+	{1, 1},{1, 1},{1, 1},{1, 1},	// pushab, pushaw, pushad, pushaf
+	{0, 1},							// pushs
+	{STACK_N, 0},					// pop
+	{1, 0},{1, 0},{1, 0},			// popln, popl, pople
+	{1, 1},{1, 1},					// popv, popve
+	{2, 2},{1, 2},					// swap, dup
+	{STACK_N, STACK_2N},			// dupe
+	{1, 1},{1, 1},					// local, global
+	{2, 1},							// array
+	{1, 0},							// exf - anything the handler pushes is its own business
+	{1, 1},{1, 1},					// inc, dec
+	{2, 1},{2, 1},{2, 1},{2, 1},	// add, sub, mul, div
+	{2, 1},{2, 1},{2, 1},{2, 1},	// mod, and, or, xor
+	{2, 1},{2, 1},{1, 1},{1, 1},	// shl, shr, neg, not
+	{1, 1},{1, 1},					// toi, tof
+	{1, 1},{2, 1},{2, 1},			// cmpnn, cmpe, cmpne
+	{2, 1},{2, 1},{2, 1},{2, 1},	// cmpge, cmple, cmpg, cmpl
+	{1, 0},							// if
+	{STACK_N, 1},					// eval
+	{1, 0},{1, 0},					// jt, jnt
+	{1, 0},{0, 0},					// jmp, jmpa
+	{1, 0},{1, 0},					// sw, rsw
+	{1, 0},{0, 0},					// call, calla
+	{0, STACK_N},					// enter
+	{0, 0},							// ret
+	{1, 0},{1, 0},{1, 0},{1, 0},	// jtb, jtw, jntb, jntw
+	{0, 0},{0, 0},					// jmpb, jmpw
+	{0, 0},							// case
+};
+
+struct MnemonicName {
+	std::string_view name;
+	CLARA_MNEMONIC mnemonic;
 };
 
-// Map of the instruction mnemonic IDs
-const std::map<std::string, CLARA_MNEMONIC> g_Mnemonics = {
+// Names and aliases of the instruction mnemonic IDs
+constexpr MnemonicName g_MnemonicNames[] = {
 	{"nop", CLARA_NOP},
 	{"break", CLARA_BREAK},
 	{"throw", CLARA_THROW},
@@ -142,6 +194,42 @@ const std::map<std::string, CLARA_MNEMONIC> g_Mnemonics = {
 	{"return", CLARA_RET}
 };
 
+// Perfect hash of the mnemonic names - the seed is searched for at compile time so that no two names share a slot
+constexpr size_t MNEMONIC_HASH_SIZE = 512;
+
+struct MnemonicHash {
+	uint32_t seed = 0;
+	uint8_t slots[MNEMONIC_HASH_SIZE] = {};		// index into g_MnemonicNames plus one, 0 if empty
+};
+
+constexpr uint32_t HashMnemonic(std::string_view name, uint32_t seed) {
+	uint32_t hash = 2166136261u ^ seed;
+	for (char c : name) {
+		hash ^= static_cast<uint8_t>(ToLower(c));
+		hash *= 16777619u;
+	}
+	return (hash ^ (hash >> 16)) & (MNEMONIC_HASH_SIZE - 1);
+}
+
+constexpr MnemonicHash BuildMnemonicHash() {
+	for (uint32_t seed = 0; seed < 0x1000; ++seed) {
+		MnemonicHash table;
+		table.seed = seed;
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < std::size(g_MnemonicNames); ++i) {
+			auto& slot = table.slots[HashMnemonic(g_MnemonicNames[i].name, seed)];
+			if (slot) ok = false;
+			else slot = static_cast<uint8_t>(i + 1);
+		}
+		if (ok) return table;
+	}
+	return MnemonicHash();
+}
+
+constexpr MnemonicHash g_MnemonicHash = BuildMnemonicHash();
+static_assert(g_MnemonicHash.slots[HashMnemonic(g_MnemonicNames[0].name, g_MnemonicHash.seed)] == 1, "no perfect hash seed found for the mnemonic names");
+
 // Mnemonics that can be used in the process of evaluating other instructions
 const std::map<CLARA_INSTRUCTION, CLARA_MNEMONIC> g_Friends = {
 	{INSN_PUSHAB, CLARA_PUSH},
@@ -179,6 +267,62 @@ const std::map<CLARA_INSTRUCTION, CLARA_MNEMONIC> g_Friends = {
 	{INSN_CALL, CLARA_PUSH},
 };
 
+// Peephole rules, tried in order at each instruction
+// {group, {pattern...}, rewrite}
+const std::vector<PeepholeRule> g_PeepholeRules = {
+	{CLARA_PEEPHOLE_NOP, {INSN_NOP}, [](const CodeInstruction*, std::vector<CodeInstruction>&) {
+		return true;
+	}},
+	// the counts of pops are unsigned bytes
+	{CLARA_PEEPHOLE_POP, {PeepholeMatch::CONST, INSN_POP}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		auto count = static_cast<uint8_t>(in[1].operands[0]);
+		if (!count) return false;
+		if (count > 1) out.emplace_back(INSN_POP, count - 1);
+		return true;
+	}},
+	{CLARA_PEEPHOLE_POP, {INSN_DUP, INSN_POP}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		auto count = static_cast<uint8_t>(in[1].operands[0]);
+		if (!count) return false;
+		if (count > 1) out.emplace_back(INSN_POP, count - 1);
+		return true;
+	}},
+	{CLARA_PEEPHOLE_POP, {INSN_POP, INSN_POP}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		uint32_t count = static_cast<uint8_t>(in[0].operands[0]) + static_cast<uint8_t>(in[1].operands[0]);
+		if (count > UINT8_MAX) return false;
+		if (count) out.emplace_back(INSN_POP, count);
+		return true;
+	}},
+	{CLARA_PEEPHOLE_POP, {INSN_POP}, [](const CodeInstruction* in, std::vector<CodeInstruction>&) {
+		return static_cast<uint8_t>(in[0].operands[0]) == 0;
+	}},
+	{CLARA_PEEPHOLE_SWAP, {INSN_SWAP, INSN_SWAP}, [](const CodeInstruction*, std::vector<CodeInstruction>&) {
+		return true;
+	}},
+	// both values are the same
+	{CLARA_PEEPHOLE_SWAP, {INSN_DUP, INSN_SWAP}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		out.push_back(in[0]);
+		return true;
+	}},
+	{CLARA_PEEPHOLE_SWAP, {PeepholeMatch::CONST, PeepholeMatch::CONST, INSN_SWAP}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		out.push_back(in[1]);
+		out.push_back(in[0]);
+		return true;
+	}},
+	// inc/dec give the same result as adding 1 for every type of value
+	{CLARA_PEEPHOLE_INC, {PeepholeMatch::INT, INSN_ADD}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		auto n = in[0].GetInt();
+		if (n != 1 && n != -1) return false;
+		out.emplace_back(n == 1 ? INSN_INC : INSN_DEC);
+		return true;
+	}},
+	{CLARA_PEEPHOLE_INC, {PeepholeMatch::INT, INSN_SUB}, [](const CodeInstruction* in, std::vector<CodeInstruction>& out) {
+		auto n = in[0].GetInt();
+		if (n != 1 && n != -1) return false;
+		out.emplace_back(n == 1 ? INSN_DEC : INSN_INC);
+		return true;
+	}},
+};
+
 // A mnemonic vector
 const std::vector<MnemonicInstruction> g_MnemonicVec = {
 	{CLARA_NOP,{INSN_NOP}},
@@ -245,7 +389,15 @@ const std::vector<MnemonicInstruction> g_MnemonicVec = {
 	{CLARA_CALL,{INSN_CALL, INSN_CALLA}},
 	{CLARA_CALL,{INSN_CALL, INSN_CALLA}},
 	{CLARA_ENTER,{INSN_ENTER}},
-	{CLARA_RET,{INSN_RET}}
+	{CLARA_RET,{INSN_RET}},
+
+	{CLARA_JT,{INSN_JT}},
+	{CLARA_JT,{INSN_JT}},
+	{CLARA_JNT,{INSN_JNT}},
+	{CLARA_JNT,{INSN_JNT}},
+	{CLARA_JMP,{INSN_JMP, INSN_JMPA}},
+	{CLARA_JMP,{INSN_JMP, INSN_JMPA}},
+	{CLARA_SWITCH,{INSN_SWITCH}}
 };
 
 // Another mnemonic vector
@@ -306,65 +458,189 @@ const std::vector<MnemonicInstruction> g_MnemonicVec2 = {
 };
 
 
-bool(*g_Output)(const char*) = [](const char * msg) {
-	return true;
-};
-bool(*g_Error)(CLARA_ERROR, const char*) = [](CLARA_ERROR, const char * msg) {
-	return true;
+// Whether an operand of the given class can be encoded as the given parameter type
+static bool FitsParam(ImmediateType type, OperandClass cls) {
+	switch (type) {
+	case Imm8: case Local8:
+		return cls == CLASS_IMM8;
+	case Imm16: case Local16: case Global16:
+		return cls == CLASS_IMM8 || cls == CLASS_IMM16;
+	case Imm32: case Local32: case Global32:
+		return cls == CLASS_IMM8 || cls == CLASS_IMM16 || cls == CLASS_IMM32;
+	case Float32:
+		return cls == CLASS_FLOAT;
+	case String32:
+		return cls == CLASS_STRING;
+	default: break;
+	}
+	return false;
+}
+
+// Instruction selection table indexed by mnemonic, operand count and the signature of operand classes
+class SelectionTable {
+	static constexpr size_t NUM_SIGNATURES = NUM_OPERAND_CLASSES * NUM_OPERAND_CLASSES;
+	static_assert(MAX_SELECT_PARAMS == 2, "NUM_SIGNATURES must cover every parameter");
+
+	std::vector<Selection> m_table;
+	Selection m_friends[MAX_MNEMONIC];		// used when there are more operands than any instruction takes
+
+	static inline size_t Index(size_t mn, size_t count, size_t signature) {
+		return (mn * (MAX_SELECT_PARAMS + 1) + count) * NUM_SIGNATURES + signature;
+	}
+
+	static Operand ParseDefault(const std::string& def) {
+		OperandArena arena;
+		std::vector<Line> lines;
+		Parser parser(arena, lines);
+		return parser.ParseOperand(def, true);
+	}
+
+	void Build(CLARA_MNEMONIC mn) {
+		auto& candidates = g_MnemonicVec2[mn].second;
+
+		for (size_t count = 0; count <= MAX_SELECT_PARAMS; ++count) {
+			for (size_t signature = 0; signature < NUM_SIGNATURES; ++signature) {
+				OperandClass classes[MAX_SELECT_PARAMS];
+				for (size_t i = 0, sig = signature; i < MAX_SELECT_PARAMS; ++i, sig /= NUM_OPERAND_CLASSES)
+					classes[i] = static_cast<OperandClass>(sig % NUM_OPERAND_CLASSES);
+
+				for (auto r : candidates) {
+					auto& type = g_Instructions[r];
+					assert(type.params.size() <= MAX_SELECT_PARAMS);
+					if (type.minParams > count || type.params.size() < count)
+						continue;
+
+					// missing parameters have to be made up entirely of default values
+					size_t missing = type.params.size() - count;
+					if (missing && type.defaults.size() != missing)
+						continue;
+
+					Selection sel;
+					sel.insn = r;
+					sel.numParams = static_cast<uint8_t>(type.params.size());
+					sel.numDefaults = static_cast<uint8_t>(missing);
+
+					bool ok = true;
+					for (size_t i = 0; ok && i < type.params.size(); ++i) {
+						auto param = *type.params[i];
+						sel.widths[i] = static_cast<uint8_t>(GetImmSize(param));
+
+						auto cls = classes[i];
+						if (i >= count) {
+							sel.defaults[i - count] = ParseDefault(type.defaults[i - count]);
+							cls = sel.defaults[i - count].GetClass();
+						}
+						ok = FitsParam(param, cls);
+					}
+
+					if (ok) {
+						m_table[Index(mn, count, signature)] = sel;
+						break;
+					}
+				}
+			}
+		}
+
+		for (auto r : candidates) {
+			if (!g_Instructions[r].params.empty()) continue;
+			auto it = g_Friends.find(r);
+			if (it == g_Friends.end()) continue;
+
+			m_friends[mn].insn = r;
+			m_friends[mn].friendMnemonic = it->second;
+			break;
+		}
+	}
+
+public:
+	SelectionTable() : m_table(MAX_MNEMONIC * (MAX_SELECT_PARAMS + 1) * NUM_SIGNATURES) {
+		for (int mn = 0; mn < MAX_MNEMONIC; ++mn)
+			Build(static_cast<CLARA_MNEMONIC>(mn));
+	}
+
+	const Selection* Find(CLARA_MNEMONIC mn, const Operand* params, size_t count) const {
+		if (mn < 0 || mn >= MAX_MNEMONIC)
+			return nullptr;
+
+		if (count <= MAX_SELECT_PARAMS) {
+			size_t signature = 0;
+			for (size_t i = count; i--; ) {
+				auto cls = params[i].GetClass();
+				if (cls == CLASS_INVALID) return nullptr;
+				signature = signature * NUM_OPERAND_CLASSES + cls;
+			}
+
+			auto& sel = m_table[Index(mn, count, signature)];
+			if (sel.insn != INSN_INVALID)
+				return &sel;
+		}
+		return count && m_friends[mn].insn != INSN_INVALID ? &m_friends[mn] : nullptr;
+	}
 };
 
-bool Error(CLARA_ERROR err, std::string msg) {
-	return g_Error(err, msg.c_str());
+const Selection* SelectInstruction(CLARA_MNEMONIC mn, const Operand* params, size_t numParams) {
+	static const SelectionTable table;
+	return table.Find(mn, params, numParams);
 }
-bool Error(CLARA_ERROR err, const std::vector<std::string>& args) {
+
+bool Context::Error(CLARA_ERROR err, const std::vector<std::string>& args) {
 	switch (err) {
 	case CLARA_ERROR_OPEN_FILE:
-		Error(err, "failed to open file '" + args[0] + "'");
-		break;
+		return Error(err, "failed to open file '" + args[0] + "'");
 	case CLARA_ERROR_INVALID_DIRECTIVE:
-		Error(err, "invalid directive '" + args[0] + "'");
-		break;
+		return Error(err, "invalid directive '" + args[0] + "'");
+	case CLARA_ERROR_INVALID_MNEMONIC:
+		return Error(err, "invalid mnemonic '" + args[0] + "'");
+	case CLARA_ERROR_UNDEFINED_LABEL:
+		return Error(err, "undefined label '" + args[0] + "'");
+	case CLARA_ERROR_DUPLICATE_LABEL:
+		return Error(err, "label '" + args[0] + "' is already defined");
+	case CLARA_ERROR_INVALID_CASE:
+		return Error(err, "invalid '" + args[0] + "' case - cases follow the switch's default and end with a target");
+	case CLARA_ERROR_DUPLICATE_CASE:
+		return Error(err, "case " + args[0] + " is already covered by the switch");
+	case CLARA_ERROR_SWITCH_TOO_LARGE:
+		return Error(err, "switch table of " + args[0] + " entries is too large");
+	case CLARA_ERROR_UNBALANCED_STACK:
+		return Error(err, "the stack depth at offset " + args[0] + " differs between the paths to it");
+	case CLARA_ERROR_STACK_UNDERFLOW:
+		return Error(err, "the instruction at offset " + args[0] + " pops more values than there are");
+	case CLARA_ERROR_DUPLICATE_STRING:
+		return Error(err, "string '" + args[0] + "' is already declared");
+	case CLARA_ERROR_DUPLICATE_GLOBAL:
+		return Error(err, "global '" + args[0] + "' is already declared");
+	case CLARA_ERROR_ALLOCATION:
+		return Error(err, "failed to allocate " + args[0] + " bytes for the output");
+	case CLARA_ERROR_INVALID_ARGUMENT:
+		return Error(err, "'" + args[0] + "' must not be null");
+	case CLARA_ERROR_INVALID_NUMBER:
+		return Error(err, "invalid number '" + args[0] + "'");
 	}
 
 	return Error(err, "unknown");
 }
-bool Output(std::string msg) {
-	return g_Output(msg.c_str());
-}
-
-template<typename TArg>
-inline bool SendError(CLARA_ERROR err, std::vector<std::string>& vec, TArg arg) {
-	vec.emplace_back(arg);
-	return Error(err, vec);
-}
-template<typename TArg, typename... TArgs>
-inline bool SendError(CLARA_ERROR err, std::vector<std::string>& vec, TArg arg, TArgs&&... args) {
-	vec.emplace_back(arg);
-	return SendError(err, vec, args...);
-}
-template<typename... TArgs>
-inline bool SendError(CLARA_ERROR err, TArgs&&... args) {
-	std::vector<std::string> vec;
-	return SendError(err, vec, args...);
-}
 
 CLARA_INSTRUCTION ReadInstruction() {
 	CLARA_INSTRUCTION op = CLARA_INSTRUCTION::INSN_ADD;
-	//g_hInput.r >> op;
 	return op;
 }
 
 const MnemonicInstruction* GetMnemonicInstruction(CLARA_MNEMONIC mn) {
 	return &g_MnemonicVec2[mn];
 }
-const MnemonicInstruction* GetMnemonicInstruction(std::string mn) {
-	auto it = g_Mnemonics.find(mn);
-	return it != g_Mnemonics.end() ? &g_MnemonicVec2[it->second] : nullptr;
+const MnemonicInstruction* GetMnemonicInstruction(std::string_view mn) {
+	auto id = FindMnemonic(mn);
+	return id != CLARA_BAD_MNEMONIC ? &g_MnemonicVec2[id] : nullptr;
+}
+CLARA_MNEMONIC FindMnemonic(std::string_view name) {
+	auto idx = g_MnemonicHash.slots[HashMnemonic(name, g_MnemonicHash.seed)];
+	if (idx && EqualsNoCase(g_MnemonicNames[idx - 1].name, name))
+		return g_MnemonicNames[idx - 1].mnemonic;
+	return CLARA_BAD_MNEMONIC;
 }
 
-void WriteOpcode(CLARA_OPCODE opcode) {
-	//fwrite(&opcode, 1, 1, g_hOutput);
-	++g_nNumOpcodesWritten;
+void WriteOpcode(Context& context, CLARA_OPCODE opcode) {
+	++context.numOpcodesWritten;
 }
 
 bool Compiler::Digest(std::string code) {
@@ -412,7 +688,7 @@ bool Compiler::Digest(std::string code) {
 					m_instructions.back().Reset();
 					m_phase = phase2;
 				}
-				else SendError(CLARA_ERROR_INVALID_MNEMONIC, code);
+				else m_context.SendError(CLARA_ERROR_INVALID_MNEMONIC, code);
 			}
 			else {
 				m_instructions.emplace_back(insn);
@@ -467,9 +743,8 @@ bool Compiler::Digest() {
 }
 
 size_t GetIntNumBytes(int32_t nVal) {
-	int v = abs(nVal);
-	if (v < 0x80) return 1;
-	if (v < 0x8000) return 2;
+	if (nVal >= INT8_MIN && nVal <= INT8_MAX) return 1;
+	if (nVal >= INT16_MIN && nVal <= INT16_MAX) return 2;
 	return 4;
 }
 size_t GetUIntNumBytes(uint32_t dwVal) {
@@ -477,47 +752,222 @@ size_t GetUIntNumBytes(uint32_t dwVal) {
 	if (dwVal <= 0xFFFF) return 2;
 	return 4;
 }
+size_t GetInstructionSize(CLARA_INSTRUCTION insn) {
+	static const struct Sizes {
+		uint8_t sizes[MAX_INSN];
+
+		Sizes() {
+			for (size_t i = 0; i < MAX_INSN; ++i) {
+				sizes[i] = 1;
+				for (auto param : g_Instructions[i].params)
+					sizes[i] += static_cast<uint8_t>(GetImmSize(*param));
+			}
+		}
+	} table;
+	return table.sizes[insn];
+}
 
-#ifdef __cplusplus
-extern "C" {
-#endif
-	CLARA_ERROR SetOutputHandler(bool(*func)(const char*)) {
-		g_Output = func;
-		return CLARA_ERROR_NONE;
+static CLARA_ERROR Compile(Context& context, const char * path_in, const char * path_out) {
+	if (!context.Output(std::string("Opening file ") + path_in))
+		return CLARA_ERROR_INTERRUPTED;
+
+	// regular files are parsed straight from a read-only mapping, anything else ("-" for stdin, pipes) is streamed
+	MappedFile source;
+	bool mapped = source.Open(path_in);
+	FILE* in = nullptr;
+	if (!mapped) in = strcmp(path_in, "-") == 0 ? stdin : fopen(path_in, "rb");
+
+	// the globals layout goes next to the output
+	bool writeMap = context.options[CLARA_OPTION_MAP] != 0;
+	auto mapPath = std::filesystem::path(path_out).replace_extension(".map");
+
+	// only mapped sources can be hashed up front
+	bool cached = mapped && !context.cacheDirectory.empty();
+	CompileCache cache(context.cacheDirectory);
+	uint64_t key = 0;
+	if (cached) {
+		// streaming skips the optimizations, so they're left out of its key
+		int options[MAX_OPTION];
+		std::copy(std::begin(context.options), std::end(context.options), options);
+		if (options[CLARA_OPTION_STREAMING])
+			options[CLARA_OPTION_PEEPHOLE] = options[CLARA_OPTION_FOLD] = 0;
+		key = CompileCache::Key(source.View(), options, MAX_OPTION);
+
+		if ((!writeMap || cache.Fetch(key, mapPath, ".map")) && cache.Fetch(key, path_out)) {
+			context.Output(std::string("Using cached ") + cache.GetPath(key).string());
+			return CLARA_ERROR_NONE;
+		}
 	}
-	CLARA_ERROR SetErrorHandler(bool(*func)(CLARA_ERROR, const char*)) {
-		g_Error = func;
-		return CLARA_ERROR_NONE;
+
+	// never write through a hard link, it may be shared with a cache entry
+	std::error_code ec;
+	if (std::filesystem::hard_link_count(path_out, ec) > 1)
+		std::filesystem::remove(path_out, ec);
+
+	if (!mapped && !in) {
+		context.SendError(CLARA_ERROR_OPEN_FILE, path_in);
+		return CLARA_ERROR_OPEN_FILE;
 	}
-	CLARA_ERROR Compile(const char * path_in, const char * path_out) {
-		if (!Output((std::string("Opening file ") + path_in).c_str()))
-			return CLARA_ERROR_INTERRUPTED;
 
-		std::ifstream in(path_in, std::ifstream::in);
-		if (!in.is_open()) {
-			SendError(CLARA_ERROR_OPEN_FILE, path_in);
+	CLARA_ERROR result = CLARA_ERROR_NONE;
+	std::ofstream out(path_out, std::ofstream::out | std::ofstream::binary);
+	if (!out.is_open()) {
+		context.SendError(CLARA_ERROR_OPEN_FILE, path_out);
+		result = CLARA_ERROR_OPEN_FILE;
+	}
+	else {
+		int numErrors = context.numErrors;
+		bool streaming = context.options[CLARA_OPTION_STREAMING] != 0;
+		BytecodeWriter streamWriter(out);
+		BytecodeWriter& writer = streaming ? streamWriter : context.writer;
+		context.numOpcodesWritten = 0;
+		context.numInstructionsRead = 0;
+		writer.Clear();
+
+		Compiler compiler = streaming ? Compiler(context, writer) : Compiler(context);
+
+		if (mapped)
+			compiler.Parse(source.View());
+		else {
+			ReadLines(in, [&](std::string_view lines, size_t offset) {
+				compiler.Parse(lines, offset);
+			});
+		}
+
+		if (streaming) {
+			compiler.Finish();
+			writer.Flush();
 		}
 		else {
-			std::ofstream out(path_out, std::ofstream::out | std::ofstream::binary);
-			if (out.is_open()) {
-				Compiler compiler;
-
-				g_nNumOpcodesWritten = 0;
-				g_nNumInstructionsRead = 0;
-
-				int lineNum = 0;
-				for (std::string line; std::getline(in, line); ++lineNum) {
-					line = line.substr(0, line.find_first_of(';'));
-					if (line.empty()) continue;
-					compiler.Parse(line);
-				}
+			compiler.Compile(writer);
+			writer.Flush(out);
+		}
+		out.close();
 
-				compiler.Compile(out);
+		// an image with errors in it is no use to anyone, so it isn't left behind
+		if (context.numErrors != numErrors) {
+			std::filesystem::remove(path_out, ec);
+			result = CLARA_ERROR_COMPILE_FAILED;
+		}
+		else {
+			bool stored = cached && out;
+			if (writeMap) {
+				std::ofstream map(mapPath, std::ofstream::out | std::ofstream::binary);
+				map << compiler.GetMap();
+				map.close();
+				if (!map) {
+					context.SendError(CLARA_ERROR_OPEN_FILE, mapPath.string());
+					stored = false;
+				}
+				else if (stored) stored = cache.Store(key, mapPath, ".map");
 			}
+			if (stored)
+				cache.Store(key, path_out);
 		}
+	}
+	if (in && in != stdin) fclose(in);
 
+	return result;
+}
+static CLARA_ERROR CompileBuffer(Context& context, const char * source, size_t size, CLARA_ALLOCATOR alloc, void * userdata, size_t * outSize) {
+	if (outSize) *outSize = 0;
+	if (!source || !alloc) {
+		context.SendError(CLARA_ERROR_INVALID_ARGUMENT, !source ? "source" : "alloc");
+		return CLARA_ERROR_INVALID_ARGUMENT;
+	}
+
+	int numErrors = context.numErrors;
+	bool streaming = context.options[CLARA_OPTION_STREAMING] != 0;
+	BytecodeWriter& writer = context.writer;
+	context.numOpcodesWritten = 0;
+	context.numInstructionsRead = 0;
+	writer.Clear();
+
+	Compiler compiler = streaming ? Compiler(context, writer) : Compiler(context);
+
+	compiler.Parse(std::string_view(source, size));
+	if (streaming) compiler.Finish();
+	else compiler.Compile(writer);
+	if (context.numErrors != numErrors)
+		return CLARA_ERROR_COMPILE_FAILED;
+
+	auto ptr = alloc(writer.Size(), userdata);
+	if (!ptr) {
+		context.SendError(CLARA_ERROR_ALLOCATION, std::to_string(writer.Size()));
+		return CLARA_ERROR_ALLOCATION;
+	}
+
+	memcpy(ptr, writer.Data(), writer.Size());
+	if (outSize) *outSize = writer.Size();
+	return CLARA_ERROR_NONE;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	CLARA_CONTEXT CreateContext() {
+		return new Context;
+	}
+	void DestroyContext(CLARA_CONTEXT context) {
+		delete context;
+	}
+	CLARA_ERROR ContextSetOutputHandler(CLARA_CONTEXT context, bool(*func)(const char*, void*), void* userdata) {
+		context->outputHandler = func;
+		context->outputData = userdata;
+		return CLARA_ERROR_NONE;
+	}
+	CLARA_ERROR ContextOutput(CLARA_CONTEXT context, const char * msg) {
+		return context->Output(msg) ? CLARA_ERROR_NONE : CLARA_ERROR_INTERRUPTED;
+	}
+	CLARA_ERROR ContextSetErrorHandler(CLARA_CONTEXT context, bool(*func)(CLARA_ERROR, const char*, void*), void* userdata) {
+		context->errorHandler = func;
+		context->errorData = userdata;
+		return CLARA_ERROR_NONE;
+	}
+	CLARA_ERROR ContextSetOption(CLARA_CONTEXT context, CLARA_OPTION option, int value) {
+		if (option < 0 || option >= MAX_OPTION)
+			return CLARA_ERROR_INVALID_OPTION;
+		context->options[option] = value;
+		return CLARA_ERROR_NONE;
+	}
+	CLARA_ERROR ContextSetCacheDirectory(CLARA_CONTEXT context, const char * path) {
+		context->cacheDirectory = path ? path : "";
 		return CLARA_ERROR_NONE;
 	}
+	CLARA_ERROR ContextCompile(CLARA_CONTEXT context, const char * path_in, const char * path_out) {
+		return Compile(*context, path_in, path_out);
+	}
+	CLARA_ERROR ContextCompileBuffer(CLARA_CONTEXT context, const char * source, size_t size, CLARA_ALLOCATOR alloc, void * userdata, size_t * outSize) {
+		return CompileBuffer(*context, source, size, alloc, userdata, outSize);
+	}
+
+	CLARA_ERROR SetOutputHandler(bool(*func)(const char*)) {
+		g_Output = func;
+		return ContextSetOutputHandler(&g_DefaultContext, [](const char* msg, void*) {
+			return g_Output ? g_Output(msg) : true;
+		}, nullptr);
+	}
+	CLARA_ERROR Output(const char * msg) {
+		return ContextOutput(&g_DefaultContext, msg);
+	}
+	CLARA_ERROR SetErrorHandler(bool(*func)(CLARA_ERROR, const char*)) {
+		g_Error = func;
+		return ContextSetErrorHandler(&g_DefaultContext, [](CLARA_ERROR err, const char* msg, void*) {
+			return g_Error ? g_Error(err, msg) : true;
+		}, nullptr);
+	}
+	CLARA_ERROR SetOption(CLARA_OPTION option, int value) {
+		return ContextSetOption(&g_DefaultContext, option, value);
+	}
+	CLARA_ERROR SetCacheDirectory(const char * path) {
+		return ContextSetCacheDirectory(&g_DefaultContext, path);
+	}
+	CLARA_ERROR Compile(const char * path_in, const char * path_out) {
+		return Compile(g_DefaultContext, path_in, path_out);
+	}
+	CLARA_ERROR CompileBuffer(const char * source, size_t size, CLARA_ALLOCATOR alloc, void * userdata, size_t * outSize) {
+		return CompileBuffer(g_DefaultContext, source, size, alloc, userdata, outSize);
+	}
 #ifdef __cplusplus
 }
 #endif
@@ -3,7 +3,7 @@
 #ifdef _MSC_VER
 	#define BREAK __debugbreak
 #else
-	#define BREAK
+	#define BREAK()
 #endif
 #ifdef __cplusplus
 	#ifndef CLARA_NAMESPACE_BEGIN
@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include "API.h"
+#include "CLARA.h"
+#include "File.h"
+
+// Bump whenever the code generation changes so stale entries are no longer hit
+#define CLARA_CACHE_VERSION 6
+
+CLARA_NAMESPACE_BEGIN
+
+// On-disk store of compiled images keyed by a hash of everything that goes into them
+// The compiler output is deterministic (no timestamps or paths in the image), so a hit is always safe to use
+class CompileCache {
+	std::filesystem::path m_directory;
+
+	static inline uint64_t Mix(uint64_t hash, uint64_t v) {
+		hash = (hash ^ v) * 0x100000001B3ull;
+		return hash ^ (hash >> 29);
+	}
+	// FNV-style hash taken a word at a time over four lanes, so large sources don't hold up a cache hit
+	static uint64_t Hash(uint64_t hash, const void* data, size_t size) {
+		auto bytes = static_cast<const uint8_t*>(data);
+		uint64_t lanes[4] = {hash, hash ^ 1, hash ^ 2, hash ^ 3};
+		uint64_t word;
+		size_t i = 0;
+
+		for (; i + 32 <= size; i += 32) {
+			for (size_t j = 0; j < 4; ++j) {
+				memcpy(&word, bytes + i + j * 8, 8);
+				lanes[j] = Mix(lanes[j], word);
+			}
+		}
+		for (; i + 8 <= size; i += 8) {
+			memcpy(&word, bytes + i, 8);
+			lanes[0] = Mix(lanes[0], word);
+		}
+		for (; i < size; ++i)
+			lanes[1] = Mix(lanes[1], bytes[i]);
+
+		for (size_t j = 1; j < 4; ++j)
+			lanes[0] = Mix(lanes[0], lanes[j]);
+		return Mix(lanes[0], size);
+	}
+
+public:
+	CompileCache(const std::string& directory) : m_directory(directory) { }
+
+	// Key for a source - covers its bytes, the header defaults it is built with, the format version and the options
+	static uint64_t Key(std::string_view source, const int* options, size_t numOptions) {
+		FileHeader header;
+		uint8_t settings[] = {
+			header.InstructionSize, header.IntegerSize,
+			CLARA_ASSEMBLY_VER_MAJOR, CLARA_ASSEMBLY_VER_MINOR, CLARA_CACHE_VERSION
+		};
+
+		uint64_t hash = 0xCBF29CE484222325ull;
+		hash = Hash(hash, settings, sizeof(settings));
+		hash = Hash(hash, options, numOptions * sizeof(*options));
+		return Hash(hash, source.data(), source.size());
+	}
+
+	// An entry is the image, plus its .map when one is asked for
+	std::filesystem::path GetPath(uint64_t key, const char* extension = ".clo") const {
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+		return m_directory / (name + std::string(extension));
+	}
+
+	// Puts the cached file for 'key' at 'path' - returns false on a miss
+	bool Fetch(uint64_t key, const std::filesystem::path& path, const char* extension = ".clo") const {
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		auto entry = GetPath(key, extension);
+		if (!fs::is_regular_file(entry, ec))
+			return false;
+
+		// link to the entry where possible, a copy is the fallback (e.g. across volumes)
+		fs::remove(path, ec);
+		fs::create_hard_link(entry, path, ec);
+		if (ec) {
+			ec.clear();
+			fs::copy_file(entry, path, fs::copy_options::overwrite_existing, ec);
+		}
+		return !ec;
+	}
+
+	// Adds a compiled file to the cache
+	// It's copied to a temporary file first and renamed into place, so readers never see a partial entry
+	bool Store(uint64_t key, const std::filesystem::path& path, const char* extension = ".clo") const {
+		namespace fs = std::filesystem;
+		static std::atomic<unsigned> counter;
+		std::error_code ec;
+		auto entry = GetPath(key, extension);
+
+		fs::create_directories(m_directory, ec);
+		auto temp = entry;
+		temp += "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." + std::to_string(counter++) + ".tmp";
+
+		if (!fs::copy_file(path, temp, fs::copy_options::overwrite_existing, ec)) {
+			fs::remove(temp, ec);
+			return false;
+		}
+		fs::rename(temp, entry, ec);
+		if (ec) fs::remove(temp, ec);
+		return !ec;
+	}
+};
+
+CLARA_NAMESPACE_END
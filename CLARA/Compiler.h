@@ -1,165 +1,385 @@
 #pragma once
+#include <algorithm>
+#include <string>
 #include <vector>
 #include <memory>
-#include <fstream>
 #include "CLARA.h"
 #include "Assembly.h"
+#include "BytecodeWriter.h"
+#include "Context.h"
+#include "File.h"
+#include "GlobalTable.h"
+#include "Optimizer.h"
 #include "Parser.h"
+#include "StackAnalysis.h"
+#include "StringPool.h"
 
 CLARA_NAMESPACE_BEGIN
 
 class Compiler {
+	Context& m_context;
+
 	enum { phase1, phase2, phase3 };
 	int m_phase = phase1;
 
 	std::vector<Instruction> m_instructions;
 	std::vector<Instruction> m_heldInstructions;
-	std::vector<std::vector<Operand>> m_lines;
+	std::vector<Line> m_lines;
+	OperandArena m_arena;
 
-	inline void CompileInstruction(std::ofstream& file, std::shared_ptr<Ins> instr, std::vector<Operand>::iterator& end, std::vector<Operand>::iterator& cur) {
-		CLARA_INSTRUCTION insn = INSN_INVALID;
-		std::vector<CLARA_INSTRUCTION> insns = GetMnemonicInstruction(instr->GetMnemonic())->second;
-		std::vector<CLARA_INSTRUCTION> considered;
-		//bool noparams = cur == line.end() || (cur + 1) == line.end();
+	std::vector<CodeInstruction> m_code;		// instructions selected for the lines, waiting to be written
+	StringPool m_strings{m_context};
+	GlobalTable m_globals{m_context};
 
-		std::vector<Operand> params;
-		for (; cur != end; ++cur) {
-			params.push_back(*cur);
-		}
+	// Labels - each is defined at an index into m_code, or a code offset in streaming mode
+	enum : size_t { UNDEFINED = SIZE_MAX };
+	struct Fixup {
+		uint32_t label;
+		size_t offset;				// code offset of the operand to patch
+	};
+	LabelTable m_labels;
+	std::vector<size_t> m_labelPositions;
+	std::vector<Fixup> m_fixups;	// forward references in streaming mode
+	size_t m_streamed = 0;			// code bytes selected in streaming mode
 
-		auto mnemonic = instr->GetMnemonic();
-		if (instr->GetInstruction() != INSN_INVALID)
-			insn = instr->GetInstruction();
-		else {
-			for (auto& r : insns) {
-				auto& instr = g_Instructions[r];
-				if (instr.minParams > params.size())
-					continue;
-				else if (instr.params.size() < params.size()) {
-					auto it = g_Friends.find(r);
-					if (it == g_Friends.end()) continue;
-
-					cur -= params.size();
-					for (size_t i = params.size(); i; --i) {
-						auto ins = std::make_shared<Ins>(it->second);
-						CompileInstruction(file, ins, cur + 1, cur);
-					}
-					insn = r;
-					params.clear();
-				}
-				else if (instr.params.size() > params.size()) {
-					if (instr.defaults.size() == (instr.params.size() - params.size())) {
-						for (auto& def : instr.defaults) {
-							Parser parser(m_lines);
-							params.emplace_back(parser.ParseOperand(def, true));
-						}
-					}
+	inline size_t GetLabelPosition(uint32_t id) const {
+		return id < m_labelPositions.size() ? m_labelPositions[id] : UNDEFINED;
+	}
+	void DefineLabel(uint32_t id) {
+		if (GetLabelPosition(id) != UNDEFINED) {
+			m_context.SendError(CLARA_ERROR_DUPLICATE_LABEL, m_labels.GetName(id));
+			return;
+		}
+		if (m_labelPositions.size() <= id) m_labelPositions.resize(id + 1, UNDEFINED);
+		m_labelPositions[id] = m_stream ? m_streamed : m_code.size();
+	}
+	// Streaming mode - branches back to a label get the shortest form, others are patched once the label is defined
+	void Link(CodeInstruction& ci) {
+		auto target = GetLabelPosition(ci.label - 1);
+		if (target == UNDEFINED) {
+			m_fixups.push_back({ci.label - 1, m_streamed + ci.GetTargetOffset()});
+			return;
+		}
+		ci.Target() = static_cast<uint32_t>(target);
+		if (!m_context.options[CLARA_OPTION_LONG_BRANCHES]) {
+			for (size_t width = 1; width <= 2; ++width) {
+				auto insn = GetShortBranch(ci.insn, width);
+				if (insn == INSN_INVALID) break;
+				auto disp = static_cast<int64_t>(target) - static_cast<int64_t>(m_streamed + 1 + width);
+				if (disp >= (width == 1 ? INT8_MIN : INT16_MIN)) {
+					ci.insn = insn;
+					ci.operands[0] = static_cast<uint32_t>(disp);
+					break;
 				}
+			}
+		}
+	}
+	void Add(CodeInstruction ci) {
+		if (m_stream) {
+			if (ci.label) Link(ci);
+			m_streamed += GetInstructionSize(ci.insn);
+		}
+		m_code.push_back(ci);
+	}
+	// Patches the forward references to labels defined since the last call
+	void ResolveFixups() {
+		auto code = m_headerOffset + sizeof(FileHeader);
+		auto it = std::remove_if(m_fixups.begin(), m_fixups.end(), [&](const Fixup& fixup) {
+			auto target = GetLabelPosition(fixup.label);
+			if (target == UNDEFINED) return false;
+			m_stream->Patch32(code + fixup.offset, static_cast<uint32_t>(target));
+			return true;
+		});
+		m_fixups.erase(it, m_fixups.end());
+	}
+	// Points the branches at the code offsets of their labels
+	void ResolveLabels() {
+		std::vector<uint32_t> offsets(m_code.size() + 1);
+		for (size_t i = 0; i < m_code.size(); ++i)
+			offsets[i + 1] = offsets[i] + static_cast<uint32_t>(GetInstructionSize(m_code[i].insn));
 
-				bool nogood = false;
-				size_t i = 0;
-				auto& args = instr.params;
-				for (auto arg : args) {
-					switch (*arg) {
-					case Imm8:
-						nogood = params[i].GetBase()->GetSize() > 1;
-						break;
-					case Imm16:
-						nogood = params[i].GetBase()->GetSize() > 2;
-						break;
-					case Imm32:
-						nogood = params[i].GetBase()->GetSize() > 4;
-						break;
-					case String32:
-						nogood = params[i].GetBase()->GetSize() > 4;
-						break;
-					case Local8:
-						nogood = params[i].GetBase()->GetSize() > 1;
-						break;
-					case Local16:
-						nogood = params[i].GetBase()->GetSize() > 2;
-						break;
-					case Local32:
-						nogood = params[i].GetBase()->GetSize() > 4;
-						break;
-					case Global16:
-						nogood = params[i].GetBase()->GetSize() > 2;
-						break;
-					case Global32:
-						nogood = params[i].GetBase()->GetSize() > 4;
-						break;
-					}
-
-					if (nogood) break;
-
-					++i;
-				}
+		std::vector<bool> reported(m_labels.Size());
+		for (auto& ci : m_code) {
+			if (!ci.label) continue;
+			auto id = ci.label - 1;
+			auto pos = GetLabelPosition(id);
+			if (pos != UNDEFINED) ci.Target() = offsets[pos];
+			else if (!reported[id]) {
+				m_context.SendError(CLARA_ERROR_UNDEFINED_LABEL, m_labels.GetName(id));
+				reported[id] = true;
+			}
+		}
+	}
+
+	// Switch being assembled - its cases follow on lines of their own, 'sw key target' or 'rsw low high target',
+	// and it's emitted once any other line comes along
+	struct Case {
+		int32_t low, high;
+		Operand target;
+	};
+	CLARA_INSTRUCTION m_switch = INSN_INVALID;
+	Operand m_switchDefault;
+	std::vector<Case> m_cases;
 
-				if (!nogood) considered.emplace_back(r);
+	static inline bool IsTarget(const Operand& op) {
+		return op.GetType() == OP_REFERENCE || (op.GetType() == OP_IMMEDIATE && op.GetKind() == Integer);
+	}
+	static inline void SetTarget(CodeInstruction& ci, const Operand& op) {
+		if (op.GetType() == OP_REFERENCE) ci.label = op.GetLabel() + 1;
+		else ci.Target() = op.GetBits();
+	}
+	void CompileSwitch(CLARA_MNEMONIC mn, const Operand* params, size_t numParams) {
+		auto insn = mn == CLARA_SWITCH ? INSN_SWITCH : INSN_RSWITCH;
+		size_t numKeys = insn == INSN_SWITCH ? 1 : 2;
+
+		if (numParams == 1 && IsTarget(params[0])) {
+			CloseSwitch();
+			m_switch = insn;
+			m_switchDefault = params[0];
+			return;
+		}
+
+		bool valid = m_switch == insn && numParams == numKeys + 1 && IsTarget(params[numKeys]);
+		for (size_t i = 0; valid && i < numKeys; ++i)
+			valid = params[i].GetType() == OP_IMMEDIATE && params[i].GetKind() == Integer;
+		auto low = static_cast<int32_t>(params[0].GetBits());
+		auto high = static_cast<int32_t>(params[numKeys - 1].GetBits());
+		if (!valid || low > high) {
+			m_context.SendError(CLARA_ERROR_INVALID_CASE, g_Instructions[insn].name);
+			return;
+		}
+		m_cases.push_back({low, high, params[numKeys]});
+	}
+	// Lays out the table of the open switch - sw keys which are at least half dense get a table indexed directly,
+	// with the gaps going to the default, others are searched. rsw tables hold the start of each range and gap.
+	void CloseSwitch() {
+		if (m_switch == INSN_INVALID) return;
+
+		std::stable_sort(m_cases.begin(), m_cases.end(), [](const Case& l, const Case& r) { return l.low < r.low; });
+		for (size_t i = 1; i < m_cases.size(); ) {
+			if (m_cases[i].low > m_cases[i - 1].high) ++i;
+			else {
+				m_context.SendError(CLARA_ERROR_DUPLICATE_CASE, std::to_string(m_cases[i].low));
+				m_cases.erase(m_cases.begin() + i);
 			}
+		}
 
-			if (considered.size())
-				insn = considered.front();
-		}
-
-		assert(insn != INSN_INVALID);
-
-		file.write(reinterpret_cast<const char*>(&insn), sizeof(insn));
-		for (auto param : params) {
-			auto size = param.GetBase()->GetSize();
-			auto type = param.GetBase()->GetType();
-			switch (type) {
-			case OP_IMMEDIATE:
-				{
-					if (size <= 1) {
-						auto v = param.Get<Imm<uint8_t>>()->GetValue<uint8_t>();
-						file.write(reinterpret_cast<const char*>(&v), 1);
-					}
-					else if (size <= 2) {
-						auto v = param.Get<Imm<uint16_t>>()->GetValue<uint16_t>();
-						file.write(reinterpret_cast<const char*>(&v), 2);
-					}
-					else {
-						auto v = param.Get<Imm<uint32_t>>()->GetValue<uint32_t>();
-						file.write(reinterpret_cast<const char*>(&v), 4);
-					}
+		std::vector<std::pair<int32_t, Operand>> entries;
+		if (m_switch == INSN_SWITCH) {
+			int64_t span = m_cases.empty() ? 0 : static_cast<int64_t>(m_cases.back().low) - m_cases.front().low + 1;
+			if (span && span <= 2 * static_cast<int64_t>(m_cases.size()) && span <= UINT16_MAX) {
+				auto it = m_cases.begin();
+				for (int64_t key = m_cases.front().low; key <= m_cases.back().low; ++key) {
+					if (it->low == key) entries.emplace_back(static_cast<int32_t>(key), (it++)->target);
+					else entries.emplace_back(static_cast<int32_t>(key), m_switchDefault);
 				}
-				break;
-			case OP_VARIABLE:
-				break;
-			case OP_INSTRUCTION:
-			case OP_INVALID:
-			default:
-				BREAK();
+			}
+			else {
+				for (auto& c : m_cases)
+					entries.emplace_back(c.low, c.target);
 			}
 		}
+		else {
+			for (size_t i = 0; i < m_cases.size(); ++i) {
+				auto& c = m_cases[i];
+				entries.emplace_back(c.low, c.target);
+				if (c.high != INT32_MAX && (i + 1 == m_cases.size() || m_cases[i + 1].low != c.high + 1))
+					entries.emplace_back(c.high + 1, m_switchDefault);
+			}
+		}
+		if (entries.size() > UINT16_MAX) {
+			m_context.SendError(CLARA_ERROR_SWITCH_TOO_LARGE, std::to_string(entries.size()));
+			entries.clear();
+		}
+
+		CodeInstruction sw(m_switch, static_cast<uint32_t>(entries.size()));
+		SetTarget(sw, m_switchDefault);
+		Add(sw);
+		for (auto& entry : entries) {
+			CodeInstruction ci(INSN_CASE, static_cast<uint32_t>(entry.first));
+			SetTarget(ci, entry.second);
+			Add(ci);
+		}
+		m_switch = INSN_INVALID;
+		m_cases.clear();
 	}
 
-public:
-	Compiler() = default;
+	// The index a global has been given, in the smallest immediate which holds it
+	Operand ResolveGlobal(const Operand& op) const {
+		if (op.GetType() != OP_GLOBAL) return op;
+		auto index = m_globals.GetIndex(op.GetGlobal());
+		if (index <= UINT8_MAX) return Operand::Imm<uint8_t>(index);
+		if (index <= UINT16_MAX) return Operand::Imm<uint16_t>(index);
+		return Operand::Imm<uint32_t>(index);
+	}
 
-	bool Digest();
-	bool Digest(std::string);
+	inline void CompileInstruction(const Operand& instr, const Operand* params, size_t numParams) {
+		// 'pop' with a byte is a count of values to drop, so a global gets popl whatever its index - the first 64K
+		// globals fit the short form
+		if (instr.GetMnemonic() == CLARA_POP && numParams == 1 && params[0].GetType() == OP_GLOBAL) {
+			auto index = m_globals.GetIndex(params[0].GetGlobal());
+			Add(CodeInstruction(index <= UINT16_MAX ? INSN_POPL : INSN_POPLE, index));
+			return;
+		}
+		// more operands than that go to the friend mnemonic one by one, and are resolved there
+		Operand resolved[MAX_SELECT_PARAMS];
+		if (numParams <= MAX_SELECT_PARAMS && std::any_of(params, params + numParams, [](const Operand& op) { return op.GetType() == OP_GLOBAL; })) {
+			for (size_t i = 0; i < numParams; ++i)
+				resolved[i] = ResolveGlobal(params[i]);
+			params = resolved;
+		}
+
+		auto sel = SelectInstruction(instr.GetMnemonic(), params, numParams);
+		assert(sel != nullptr);
+		if (!sel) return;
+
+		if (sel->friendMnemonic != CLARA_BAD_MNEMONIC) {
+			// the operands are passed to the friend mnemonic first, then the instruction works on the results
+			auto ins = Operand::Ins(sel->friendMnemonic);
+			for (size_t i = 0; i < numParams; ++i)
+				CompileInstruction(ins, params + i, 1);
+			numParams = 0;
+		}
 
-	void Parse(std::string code) {
-		Parser parser(code, m_lines);
+		CodeInstruction ci(sel->insn);
+		for (size_t i = 0; i < sel->numParams; ++i) {
+			auto& op = i < numParams ? params[i] : sel->defaults[i - numParams];
+			if (op.GetType() == OP_REFERENCE) ci.label = op.GetLabel() + 1;
+			else ci.operands[i] = op.GetBits();
+		}
+		Add(ci);
 	}
-	void Compile(std::ofstream& file) {
-		size_t i = 0;
+
+	// Output of the streaming mode, where each line is emitted as soon as it has been parsed
+	BytecodeWriter* m_stream = nullptr;
+	size_t m_headerOffset = 0;
+	uint32_t m_stackSize = 0;		// 0 leaves it to the VM
+
+	// Sizes the stack for the code, which has to be balanced
+	void AnalyzeStack() {
+		StackAnalysis analysis(m_code);
+		auto offset = std::to_string(analysis.GetOffset());
+		switch (analysis.GetResult()) {
+		case STACK_OK:
+			m_stackSize = analysis.GetStackSize();
+			break;
+		case STACK_UNBALANCED:
+			m_context.SendError(CLARA_ERROR_UNBALANCED_STACK, offset);
+			break;
+		case STACK_UNDERFLOW:
+			m_context.SendError(CLARA_ERROR_STACK_UNDERFLOW, offset);
+			break;
+		case STACK_RECURSIVE:
+			m_context.Output("Stack: size left to the VM, the call at offset " + offset + " is recursive");
+			break;
+		case STACK_UNFOLLOWABLE:
+			m_context.Output("Stack: size left to the VM, the branch at offset " + offset + " can't be followed");
+			break;
+		}
+	}
+
+	// Selects the instructions for the parsed lines
+	void Select() {
 		for (auto& ln : m_lines) {
 			auto it = ln.begin();
-			auto op = *it;
+			auto& op = *it;
 
-			switch (op.GetBase()->GetType()) {
+			switch (op.GetType()) {
 			case OP_INSTRUCTION:
-				CompileInstruction(file, op.Get<Ins>(), ln.end(), ++it);
+				if (op.GetMnemonic() == CLARA_SWITCH || op.GetMnemonic() == CLARA_RSWITCH) {
+					CompileSwitch(op.GetMnemonic(), it + 1, ln.size() - 1);
+					break;
+				}
+				CloseSwitch();
+				CompileInstruction(op, it + 1, ln.size() - 1);
+				break;
+			case OP_LABEL:
+				CloseSwitch();
+				DefineLabel(op.GetLabel());
 				break;
+			default: break;
 			}
+		}
+	}
+	void Emit(BytecodeWriter& out) {
+		for (auto& ci : m_code)
+			ci.Write(out);
+		m_code.clear();
+	}
+	// Follows the code with the segments and fills in the header
+	void WriteHeader(BytecodeWriter& out) {
+		FileHeader header;
+		header.GlobalsOffset = static_cast<uint32_t>(out.Size() - m_headerOffset);
+		header.StackSize = m_stackSize;
+		header.NumGlobals = static_cast<uint32_t>(m_globals.Size());
+		m_globals.Write(out);
+		header.StringSegmentSize = static_cast<uint32_t>(m_strings.Write(out));
+		out.Patch(m_headerOffset, &header, sizeof(header));
+	}
+
+public:
+	Compiler(Context& context) : m_context(context) { }
+	// Streaming mode - only the line being parsed is kept in memory, call Finish() to complete the image
+	Compiler(Context& context, BytecodeWriter& out) : m_context(context), m_stream(&out) {
+		m_headerOffset = out.Reserve(sizeof(FileHeader));
+	}
+
+	bool Digest();
+	bool Digest(std::string);
+
+	// Parses lines of code - 'offset' is where they start in the source, for diagnostics
+	void Parse(std::string_view code, size_t offset = 0) {
+		Lexer lexer(code, offset);
+		Parser parser(m_arena, m_lines, &m_labels, &m_strings, &m_globals, &m_context);
+
+		if (!m_stream) {
+			while (parser.ParseLine(lexer));
+			return;
+		}
+
+		for (bool more = true; more; ) {
+			more = parser.ParseLine(lexer);
 
-			++i;
+			Select();
+			Emit(*m_stream);
+			ResolveFixups();
+			m_lines.clear();
+			m_arena.Reset();
+			m_stream->Sync();
 		}
-		i = 0;
 	}
+	// Emits the image - the file header followed by the code, globals and strings
+	void Compile(BytecodeWriter& out) {
+		m_headerOffset = out.Reserve(sizeof(FileHeader));
+		m_globals.Layout();
+		Select();
+		CloseSwitch();
+		ResolveLabels();
+		if (m_context.options[CLARA_OPTION_FOLD])
+			Optimizer(m_context, m_code).Fold();
+		if (int peephole = m_context.options[CLARA_OPTION_PEEPHOLE])
+			Optimizer(m_context, m_code).Peephole(peephole);
+		if (!m_context.options[CLARA_OPTION_LONG_BRANCHES])
+			Optimizer(m_context, m_code).Relax();
+		AnalyzeStack();
+		Emit(out);
+		WriteHeader(out);
+	}
+	// Completes the image in streaming mode
+	void Finish() {
+		assert(m_stream);
+		CloseSwitch();
+		Emit(*m_stream);
+		ResolveFixups();
+		for (auto& fixup : m_fixups) {
+			if (std::none_of(m_fixups.data(), &fixup, [&](const Fixup& f) { return f.label == fixup.label; }))
+				m_context.SendError(CLARA_ERROR_UNDEFINED_LABEL, m_labels.GetName(fixup.label));
+		}
+		WriteHeader(*m_stream);
+	}
+
+	// Where each global went, for the .map file
+	inline std::string GetMap() const { return m_globals.GetMap(); }
 };
 
 CLARA_NAMESPACE_END
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "API.h"
+#include "CLARA.h"
+#include "BytecodeWriter.h"
+
+#define MAX_BUFFER 64
+
+CLARA_NAMESPACE_BEGIN
+
+// Everything a compile touches - separate contexts can be used from separate threads at the same time
+struct Context {
+	bool(*outputHandler)(const char*, void*) = nullptr;
+	void* outputData = nullptr;
+	bool(*errorHandler)(CLARA_ERROR, const char*, void*) = nullptr;
+	void* errorData = nullptr;
+
+	int options[MAX_OPTION] = {};
+	std::string cacheDirectory;		// compiled images are cached here when set
+
+	int numInstructionsRead = 0;
+	int numOpcodesWritten = 0;
+	int numErrors = 0;
+
+	// scratch space kept between compiles
+	BytecodeWriter writer;
+	char buffer[MAX_BUFFER];
+	char* bufferCurrent = buffer;
+	const char* bufferEnd = &buffer[MAX_BUFFER];
+
+	// Passes a message to the output handler - returns false if the handler asks to stop
+	bool Output(const std::string& msg) {
+		return outputHandler ? outputHandler(msg.c_str(), outputData) : true;
+	}
+	bool Error(CLARA_ERROR err, const std::string& msg) {
+		++numErrors;
+		return errorHandler ? errorHandler(err, msg.c_str(), errorData) : true;
+	}
+	// Formats the message for an error from its arguments
+	bool Error(CLARA_ERROR err, const std::vector<std::string>& args);
+
+	template<typename TArg>
+	inline bool SendError(CLARA_ERROR err, std::vector<std::string>& vec, TArg arg) {
+		vec.emplace_back(arg);
+		return Error(err, vec);
+	}
+	template<typename TArg, typename... TArgs>
+	inline bool SendError(CLARA_ERROR err, std::vector<std::string>& vec, TArg arg, TArgs&&... args) {
+		vec.emplace_back(arg);
+		return SendError(err, vec, args...);
+	}
+	template<typename... TArgs>
+	inline bool SendError(CLARA_ERROR err, TArgs&&... args) {
+		std::vector<std::string> vec;
+		return SendError(err, vec, args...);
+	}
+};
+
+CLARA_NAMESPACE_END
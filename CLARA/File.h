@@ -3,6 +3,11 @@
 #include <fstream>
 #include "API.h"
 
+// Layout of a compiled script:
+//	FileHeader
+//	code		up to GlobalsOffset
+//	globals		NumGlobals 4-byte initial values
+//	strings		StringSegmentSize bytes - a uint32_t count, that many StringEntry, then the texts
 #pragma pack(push, 1)
 struct FileHeader {
 	uint32_t Signature;					// identifier for CLEO scripts
@@ -17,7 +22,7 @@ struct FileHeader {
 	uint8_t InstructionSize;
 	uint8_t IntegerSize;
 	uint32_t NumGlobals;		// specifies the amount of global space to reserve
-	uint32_t GlobalsOffset;		// 
+	uint32_t GlobalsOffset;		// offset of the globals segment from the start of the file, which is also the end of the code
 
 	uint32_t StackSize;			// how much space is needed for the stack in total?
 	uint32_t StringSegmentSize;	// specifies the total size of the strings segment
@@ -29,7 +34,7 @@ struct FileHeader {
 
 									// Make sure any loaded script was not built for a newer version
 		VersionMinor = CLARA_ASSEMBLY_VER_MINOR;
-		VersionMajor = CLARA_ASSEMBLY_VER_MINOR;
+		VersionMajor = CLARA_ASSEMBLY_VER_MAJOR;
 
 		// Set up defaults
 		InstructionSize = 1;
@@ -42,11 +47,11 @@ struct FileHeader {
 	}
 
 	// Attempts to validate the header - returns true on success
-	inline bool Validate() {
+	inline bool Validate() const {
 		return (
 			Signature == 'CLE' &&
 			Architecture == 'RSCM' &&
-			(VersionMajor <= CLARA_ASSEMBLY_VER_MAJOR && VersionMinor <= CLARA_ASSEMBLY_VER_MINOR)
+			(VersionMajor < CLARA_ASSEMBLY_VER_MAJOR || (VersionMajor == CLARA_ASSEMBLY_VER_MAJOR && VersionMinor <= CLARA_ASSEMBLY_VER_MINOR))
 			);
 	}
 
@@ -58,4 +63,20 @@ struct FileHeader {
 		return Validate();
 	}
 };
-#pragma pack(pop)
\ No newline at end of file
+
+// Entry of the string table - pushs takes the index of one
+// Texts are NUL-terminated, and a string which ends another one shares its bytes
+struct StringEntry {
+	uint32_t Offset;			// of the text from the end of the table
+	uint32_t Length;			// of the text, excluding the NUL
+	uint32_t Hash;				// HashString() of the text
+};
+#pragma pack(pop)
+
+// FNV-1a hash of a string - stored with it, so the VM can look strings up without hashing its own
+inline uint32_t HashString(const char* text, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+		hash = (hash ^ static_cast<uint8_t>(text[i])) * 16777619u;
+	return hash;
+}
\ No newline at end of file
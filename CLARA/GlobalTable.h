@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "CLARA.h"
+#include "BytecodeWriter.h"
+#include "Context.h"
+#include "Lexer.h"
+
+CLARA_NAMESPACE_BEGIN
+
+// The globals declared with '.globals' - numbered in the order they're declared, and given their indexes in the
+// globals segment by Layout(), hottest first, so the ones used most share the first cache lines and the short
+// popl/popv encodings
+class GlobalTable {
+	struct Global {
+		std::string name;
+		uint32_t references = 0;
+	};
+
+	Context& m_context;
+	std::vector<Global> m_globals;
+	std::vector<uint32_t> m_indexes;		// segment index of each global, by ID
+	std::unordered_map<std::string, uint32_t> m_ids;
+
+	static std::string Key(std::string_view name) {
+		std::string key(name);
+		for (auto& c : key) c = ToLower(c);
+		return key;
+	}
+
+public:
+	enum : uint32_t { NONE = UINT32_MAX };
+
+	GlobalTable(Context& context) : m_context(context) { }
+
+	void Declare(std::string_view name) {
+		auto id = static_cast<uint32_t>(m_globals.size());
+		if (!m_ids.emplace(Key(name), id).second) {
+			m_context.SendError(CLARA_ERROR_DUPLICATE_GLOBAL, std::string(name));
+			return;
+		}
+		m_globals.push_back({std::string(name), 0});
+		m_indexes.push_back(id);
+	}
+	// Reports a malformed declaration
+	inline void Reject(const char* directive) {
+		m_context.SendError(CLARA_ERROR_INVALID_DIRECTIVE, directive);
+	}
+	// ID of a declared global, or NONE
+	uint32_t Find(std::string_view name) const {
+		auto it = m_ids.find(Key(name));
+		return it != m_ids.end() ? it->second : NONE;
+	}
+	inline void Reference(uint32_t id) { ++m_globals[id].references; }
+
+	inline size_t Size() const { return m_globals.size(); }
+	inline uint32_t GetIndex(uint32_t id) const { return m_indexes[id]; }
+
+	// Orders the globals by how often the code refers to them, ties keeping their declaration order
+	// Until this is called (as in streaming mode, where the references aren't known up front) that's all they have
+	void Layout() {
+		std::vector<uint32_t> order(m_globals.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [this](uint32_t l, uint32_t r) {
+			return m_globals[l].references > m_globals[r].references;
+		});
+		for (size_t i = 0; i < order.size(); ++i)
+			m_indexes[order[i]] = static_cast<uint32_t>(i);
+	}
+
+	// Writes the globals segment - every global starts at 0
+	void Write(BytecodeWriter& out) const {
+		out.Reserve(m_globals.size() * 4);
+	}
+	// Lists the layout, one global per line in segment order
+	std::string GetMap() const {
+		std::vector<uint32_t> order(m_globals.size());
+		for (uint32_t id = 0; id < m_globals.size(); ++id)
+			order[m_indexes[id]] = id;
+
+		std::string map = "; index\treferences\tname\n";
+		for (uint32_t index = 0; index < order.size(); ++index) {
+			auto& global = m_globals[order[index]];
+			map += std::to_string(index) + "\t" + std::to_string(global.references) + "\t" + global.name + "\n";
+		}
+		return map;
+	}
+};
+
+CLARA_NAMESPACE_END
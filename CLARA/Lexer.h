@@ -0,0 +1,120 @@
+#pragma once
+#include <string_view>
+#include "CLARA.h"
+
+CLARA_NAMESPACE_BEGIN
+
+enum TokenType {
+	TOKEN_END,			// end of the input buffer
+	TOKEN_NEWLINE,		// end of a source line
+	TOKEN_COMMA,
+	TOKEN_DIRECTIVE,	// '.' followed by the directive name
+	TOKEN_NUMBER,
+	TOKEN_STRING,		// quoted string - the text excludes the quotes
+	TOKEN_IDENTIFIER,
+	TOKEN_LABEL,		// label definition - the text excludes the trailing ':'
+};
+
+struct Token {
+	TokenType type = TOKEN_END;
+	std::string_view text;
+	size_t offset = 0;			// byte offset of the token in the source buffer
+};
+
+constexpr char ToLower(char c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Case-insensitive comparison of two strings without copying either of them
+inline bool EqualsNoCase(std::string_view l, std::string_view r) {
+	if (l.size() != r.size()) return false;
+	for (size_t i = 0; i < l.size(); ++i) {
+		if (ToLower(l[i]) != ToLower(r[i]))
+			return false;
+	}
+	return true;
+}
+
+// Single-pass tokenizer which works directly on the source buffer - tokens are views into it
+class Lexer {
+	std::string_view m_source;
+	size_t m_pos = 0;
+	size_t m_base = 0;
+
+	static inline bool IsSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+	}
+	static inline bool IsDelimiter(char c) {
+		return IsSpace(c) || c == '\n' || c == ',' || c == ';' || c == '"';
+	}
+	static inline bool IsDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	inline Token Make(TokenType type, size_t begin, size_t end) const {
+		Token tok;
+		tok.type = type;
+		tok.text = m_source.substr(begin, end - begin);
+		tok.offset = m_base + begin;
+		return tok;
+	}
+
+public:
+	// 'base' is the offset of 'source' within the whole input, used for token offsets
+	Lexer(std::string_view source, size_t base = 0) : m_source(source), m_base(base) { }
+
+	Token Next() {
+		const size_t size = m_source.size();
+
+		for (;;) {
+			while (m_pos < size && IsSpace(m_source[m_pos]))
+				++m_pos;
+			if (m_pos >= size)
+				return Make(TOKEN_END, size, size);
+			if (m_source[m_pos] != ';')
+				break;
+
+			// comments run to the end of the line
+			while (m_pos < size && m_source[m_pos] != '\n')
+				++m_pos;
+		}
+
+		size_t begin = m_pos;
+		char c = m_source[m_pos++];
+
+		switch (c) {
+		case '\n':
+			return Make(TOKEN_NEWLINE, begin, m_pos);
+		case ',':
+			return Make(TOKEN_COMMA, begin, m_pos);
+		case '"':
+			while (m_pos < size && m_source[m_pos] != '"' && m_source[m_pos] != '\n')
+				++m_pos;
+			{
+				auto tok = Make(TOKEN_STRING, begin + 1, m_pos);
+				if (m_pos < size && m_source[m_pos] == '"')
+					++m_pos;
+				return tok;
+			}
+		}
+
+		while (m_pos < size && !IsDelimiter(m_source[m_pos]))
+			++m_pos;
+
+		if (c == '.')
+			return Make(TOKEN_DIRECTIVE, begin, m_pos);
+		if (IsDigit(c) || c == '-')
+			return Make(TOKEN_NUMBER, begin, m_pos);
+		if (m_pos - begin > 1 && m_source[m_pos - 1] == ':')
+			return Make(TOKEN_LABEL, begin, m_pos - 1);
+		return Make(TOKEN_IDENTIFIER, begin, m_pos);
+	}
+
+	// Skips the remainder of the current line, leaving the newline to be returned next
+	void SkipLine() {
+		while (m_pos < m_source.size() && m_source[m_pos] != '\n')
+			++m_pos;
+	}
+};
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,120 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <string_view>
+#include <vector>
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+#include "CLARA.h"
+
+CLARA_NAMESPACE_BEGIN
+
+// Read-only memory mapping of a whole regular file
+class MappedFile {
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	HANDLE m_mapping = nullptr;
+#endif
+
+public:
+	MappedFile() = default;
+	MappedFile(const char* path) {
+		Open(path);
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() {
+		Close();
+	}
+
+	// Maps the file - fails if it can't be opened or isn't a regular file (pipes, terminals...)
+	bool Open(const char* path) {
+		Close();
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER size;
+		bool ok = GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size);
+		if (ok && size.QuadPart) {
+			m_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			m_data = m_mapping ? static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+			ok = m_data != nullptr;
+			if (ok) m_size = static_cast<size_t>(size.QuadPart);
+		}
+		CloseHandle(file);
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+		if (ok && st.st_size) {
+			void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			ok = ptr != MAP_FAILED;
+			if (ok) {
+				madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+				m_data = static_cast<const char*>(ptr);
+				m_size = static_cast<size_t>(st.st_size);
+			}
+		}
+		close(fd);
+#endif
+		if (!ok) Close();
+		return ok;
+	}
+	void Close() {
+#ifdef _WIN32
+		if (m_data) UnmapViewOfFile(m_data);
+		if (m_mapping) CloseHandle(m_mapping);
+		m_mapping = nullptr;
+#else
+		if (m_data) munmap(const_cast<char*>(m_data), m_size);
+#endif
+		m_data = nullptr;
+		m_size = 0;
+	}
+
+	inline const char* Data() const { return m_data; }
+	inline size_t Size() const { return m_size; }
+	inline std::string_view View() const { return std::string_view(m_data, m_size); }
+};
+
+// Streams whole lines from a file which can't be mapped, calling func(lines, offset) for each chunk
+template<typename TFunc>
+bool ReadLines(FILE* file, TFunc&& func, size_t chunkSize = 0x10000) {
+	std::vector<char> buffer(chunkSize);
+	size_t used = 0, offset = 0;
+
+	for (;;) {
+		if (used == buffer.size())
+			buffer.resize(buffer.size() * 2);
+
+		size_t n = fread(buffer.data() + used, 1, buffer.size() - used, file);
+		if (!n) break;
+		used += n;
+
+		// pass on everything up to the last complete line and keep the remainder for the next read
+		size_t end = used;
+		while (end && buffer[end - 1] != '\n')
+			--end;
+		if (!end) continue;
+
+		func(std::string_view(buffer.data(), end), offset);
+		offset += end;
+		used -= end;
+		memmove(buffer.data(), buffer.data() + end, used);
+	}
+
+	if (used) func(std::string_view(buffer.data(), used), offset);
+	return !ferror(file);
+}
+
+CLARA_NAMESPACE_END
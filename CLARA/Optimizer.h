@@ -0,0 +1,616 @@
+#pragma once
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "CLARA.h"
+#include "Assembly.h"
+#include "BytecodeWriter.h"
+#include "Context.h"
+
+CLARA_NAMESPACE_BEGIN
+
+// An instruction selected for emission, before it's written out
+struct CodeInstruction {
+	CLARA_INSTRUCTION insn = INSN_INVALID;
+	uint32_t operands[MAX_SELECT_PARAMS] = {};		// 32-bit values, the low bytes are the narrower encodings
+	uint32_t label = 0;								// ID + 1 of the label the target operand is resolved from
+
+	CodeInstruction() { }
+	CodeInstruction(CLARA_INSTRUCTION in, uint32_t op = 0) : insn(in) {
+		operands[0] = op;
+	}
+
+	// The value an integer push puts on the stack - the operand sign-extended from its encoding, as the VM reads it
+	inline int32_t GetInt() const {
+		switch (insn) {
+		case INSN_PUSHB: return static_cast<int8_t>(operands[0]);
+		case INSN_PUSHW: return static_cast<int16_t>(operands[0]);
+		default: break;
+		}
+		return static_cast<int32_t>(operands[0]);
+	}
+	// Whether this branches to the offset in its target operand - switch table entries count as branches
+	inline bool IsBranch() const {
+		switch (insn) {
+		case INSN_JT: case INSN_JNT: case INSN_JMPA: case INSN_CALLA:
+		case INSN_SWITCH: case INSN_RSWITCH: case INSN_CASE:
+			return true;
+		default: break;
+		}
+		return false;
+	}
+	// The operand holding the target of a branch - switches have their default there
+	inline size_t GetTargetIndex() const {
+		return insn == INSN_SWITCH || insn == INSN_RSWITCH || insn == INSN_CASE ? 1 : 0;
+	}
+	inline uint32_t& Target() { return operands[GetTargetIndex()]; }
+	inline uint32_t Target() const { return operands[GetTargetIndex()]; }
+	// Offset of the target operand from the start of the instruction
+	size_t GetTargetOffset() const {
+		size_t offset = 1;
+		auto& params = g_Instructions[insn].params;
+		for (size_t i = 0; i < GetTargetIndex(); ++i)
+			offset += GetImmSize(*params[i]);
+		return offset;
+	}
+
+	void Write(BytecodeWriter& out) const {
+		out.Put8(static_cast<uint8_t>(insn));
+		auto& params = g_Instructions[insn].params;
+		for (size_t i = 0; i < params.size(); ++i)
+			out.Put(operands[i], GetImmSize(*params[i]));
+	}
+};
+
+// A value known at compile time, held as the VM holds it
+struct Constant {
+	BasicType type = Null;
+	union {
+		int32_t nValue = 0;
+		uint32_t dwValue;
+		float fValue;
+	};
+
+	static inline Constant Make(BasicType type, int32_t v) {
+		Constant c;
+		c.type = type;
+		c.nValue = v;
+		return c;
+	}
+	static inline Constant MakeInt(int32_t v) { return Make(Integer, v); }
+	static inline Constant MakeFloat(float v) {
+		Constant c;
+		c.type = Float;
+		c.fValue = v;
+		return c;
+	}
+
+	// The same conversions as the VM's
+	inline bool IsFloat() const { return type == Float; }
+	inline int32_t ToInt() const {
+		if (type != Float) return nValue;
+		if (fValue >= 2147483647.0f) return INT32_MAX;
+		if (fValue <= -2147483648.0f) return INT32_MIN;
+		return fValue == fValue ? static_cast<int32_t>(fValue) : 0;
+	}
+	inline float ToFloat() const {
+		return type == Float ? fValue : static_cast<float>(nValue);
+	}
+	inline bool IsTrue() const {
+		return type == Float ? fValue != 0.0f : nValue != 0;
+	}
+
+	// The smallest push of the value
+	CodeInstruction ToPush() const {
+		switch (type) {
+		case Null: return CodeInstruction(INSN_PUSHN);
+		case Float: return CodeInstruction(INSN_PUSHF, dwValue);
+		case String: return CodeInstruction(INSN_PUSHS, dwValue);
+		default: break;
+		}
+		switch (GetIntNumBytes(nValue)) {
+		case 1: return CodeInstruction(INSN_PUSHB, static_cast<uint8_t>(nValue));
+		case 2: return CodeInstruction(INSN_PUSHW, static_cast<uint16_t>(nValue));
+		}
+		return CodeInstruction(INSN_PUSHD, dwValue);
+	}
+};
+
+// Runs an instruction on constants at the top of 'stack', as the VM would - returns false, leaving the stack alone,
+// if it does anything else (or would fail)
+inline bool Evaluate(const CodeInstruction& ci, std::vector<Constant>& stack) {
+	auto need = [&](size_t n) { return stack.size() >= n; };
+	auto arith = [](const Constant& a, const Constant& b, CLARA_INSTRUCTION insn) {
+		if (a.IsFloat() || b.IsFloat()) {
+			float l = a.ToFloat(), r = b.ToFloat();
+			switch (insn) {
+			case INSN_ADD: return Constant::MakeFloat(l + r);
+			case INSN_SUB: return Constant::MakeFloat(l - r);
+			case INSN_MUL: return Constant::MakeFloat(l * r);
+			case INSN_DIV: return Constant::MakeFloat(l / r);
+			default: return Constant::MakeFloat(fmodf(l, r));
+			}
+		}
+		uint32_t l = a.dwValue, r = b.dwValue;
+		switch (insn) {
+		case INSN_ADD: return Constant::MakeInt(static_cast<int32_t>(l + r));
+		case INSN_SUB: return Constant::MakeInt(static_cast<int32_t>(l - r));
+		case INSN_MUL: return Constant::MakeInt(static_cast<int32_t>(l * r));
+		case INSN_DIV: return Constant::MakeInt(b.nValue == -1 ? static_cast<int32_t>(0u - l) : a.nValue / b.nValue);
+		default: return Constant::MakeInt(b.nValue == -1 ? 0 : a.nValue % b.nValue);
+		}
+	};
+	auto compare = [](const Constant& a, const Constant& b, CLARA_INSTRUCTION insn) {
+		bool fl = a.IsFloat() || b.IsFloat();
+		float lf = a.ToFloat(), rf = b.ToFloat();
+		int32_t l = a.nValue, r = b.nValue;
+		switch (insn) {
+		case INSN_CMPE: return fl ? lf == rf : l == r;
+		case INSN_CMPNE: return fl ? lf != rf : l != r;
+		case INSN_CMPGE: return fl ? lf >= rf : l >= r;
+		case INSN_CMPLE: return fl ? lf <= rf : l <= r;
+		case INSN_CMPG: return fl ? lf > rf : l > r;
+		default: return fl ? lf < rf : l < r;
+		}
+	};
+
+	switch (ci.insn) {
+	case INSN_PUSHN:
+		stack.push_back(Constant());
+		return true;
+	case INSN_PUSHB: case INSN_PUSHW: case INSN_PUSHD:
+		stack.push_back(Constant::MakeInt(ci.GetInt()));
+		return true;
+	case INSN_PUSHF:
+		stack.push_back(Constant::Make(Float, ci.operands[0]));
+		return true;
+	case INSN_PUSHS:
+		stack.push_back(Constant::Make(String, ci.operands[0]));
+		return true;
+	case INSN_POP:
+		{
+			auto n = static_cast<uint8_t>(ci.operands[0]);
+			if (!need(n)) return false;
+			stack.resize(stack.size() - n);
+		}
+		return true;
+	case INSN_SWAP:
+		if (!need(2)) return false;
+		std::swap(stack.end()[-1], stack.end()[-2]);
+		return true;
+	case INSN_DUP:
+		if (!need(1)) return false;
+		stack.push_back(stack.back());
+		return true;
+	case INSN_DUPE:
+		{
+			auto n = static_cast<uint8_t>(ci.operands[0]);
+			if (!need(n)) return false;
+			stack.insert(stack.end(), stack.end() - n, stack.end());
+		}
+		return true;
+	default: break;
+	}
+
+	// everything else replaces its operands with a result
+	Constant res;
+	size_t numOperands = 1;
+	switch (ci.insn) {
+	case INSN_PUSHAB: case INSN_PUSHAW: case INSN_PUSHAD: case INSN_PUSHAF:
+	case INSN_INC: case INSN_DEC: case INSN_NEG: case INSN_NOT:
+	case INSN_TOI: case INSN_TOF: case INSN_CMPNN:
+		if (!need(1)) return false;
+		{
+			auto& a = stack.back();
+			switch (ci.insn) {
+			case INSN_PUSHAB: res = Constant::MakeInt(static_cast<int8_t>(a.ToInt())); break;
+			case INSN_PUSHAW: res = Constant::MakeInt(static_cast<int16_t>(a.ToInt())); break;
+			case INSN_PUSHAD: case INSN_TOI: res = Constant::MakeInt(a.ToInt()); break;
+			case INSN_PUSHAF: case INSN_TOF: res = Constant::MakeFloat(a.ToFloat()); break;
+			case INSN_INC:
+				res = a.IsFloat() ? Constant::MakeFloat(a.fValue + 1.0f) : Constant::MakeInt(static_cast<int32_t>(a.dwValue + 1));
+				break;
+			case INSN_DEC:
+				res = a.IsFloat() ? Constant::MakeFloat(a.fValue - 1.0f) : Constant::MakeInt(static_cast<int32_t>(a.dwValue - 1));
+				break;
+			case INSN_NEG:
+				res = a.IsFloat() ? Constant::MakeFloat(-a.fValue) : Constant::MakeInt(static_cast<int32_t>(0u - a.dwValue));
+				break;
+			case INSN_NOT: res = Constant::MakeInt(~a.ToInt()); break;
+			case INSN_CMPNN: res = Constant::MakeInt(a.type != Null); break;
+			default: break;
+			}
+		}
+		break;
+	case INSN_ADD: case INSN_SUB: case INSN_MUL: case INSN_DIV: case INSN_MOD:
+	case INSN_AND: case INSN_OR: case INSN_XOR: case INSN_SHL: case INSN_SHR:
+	case INSN_CMPE: case INSN_CMPNE: case INSN_CMPGE: case INSN_CMPLE: case INSN_CMPG: case INSN_CMPL:
+		if (!need(2)) return false;
+		numOperands = 2;
+		{
+			auto& a = stack.end()[-2];
+			auto& b = stack.end()[-1];
+			int32_t l = a.ToInt(), r = b.ToInt();
+			switch (ci.insn) {
+			case INSN_DIV: case INSN_MOD:
+				// dividing by zero is left to fail at runtime
+				if (!a.IsFloat() && !b.IsFloat() && !b.nValue) return false;
+				[[fallthrough]];
+			case INSN_ADD: case INSN_SUB: case INSN_MUL:
+				res = arith(a, b, ci.insn);
+				break;
+			case INSN_AND: res = Constant::MakeInt(l & r); break;
+			case INSN_OR: res = Constant::MakeInt(l | r); break;
+			case INSN_XOR: res = Constant::MakeInt(l ^ r); break;
+			case INSN_SHL: res = Constant::MakeInt(static_cast<int32_t>(static_cast<uint32_t>(l) << (r & 31))); break;
+			case INSN_SHR: res = Constant::MakeInt(l >> (r & 31)); break;
+			default: res = Constant::MakeInt(compare(a, b, ci.insn)); break;
+			}
+		}
+		break;
+	case INSN_EVAL:
+		numOperands = static_cast<uint8_t>(ci.operands[0]);
+		if (!need(numOperands)) return false;
+		res = Constant::MakeInt(std::all_of(stack.end() - numOperands, stack.end(), [](const Constant& c) { return c.IsTrue(); }));
+		break;
+	default:
+		return false;
+	}
+
+	stack.resize(stack.size() - numOperands);
+	stack.push_back(res);
+	return true;
+}
+
+// Short form of a branch with a 'width' byte displacement, or INSN_INVALID if there isn't one
+inline CLARA_INSTRUCTION GetShortBranch(CLARA_INSTRUCTION insn, size_t width) {
+	switch (insn) {
+	case INSN_JT: return width == 1 ? INSN_JTB : INSN_JTW;
+	case INSN_JNT: return width == 1 ? INSN_JNTB : INSN_JNTW;
+	case INSN_JMPA: return width == 1 ? INSN_JMPB : INSN_JMPW;
+	default: break;
+	}
+	return INSN_INVALID;
+}
+
+// One element of a peephole pattern - an instruction, or any of a class of them
+struct PeepholeMatch {
+	enum Class : uint8_t {
+		INSN,			// just 'insn'
+		CONST,			// any push of a constant (pushn/b/w/d/f/s)
+		INT,			// any push of an integer constant (pushb/w/d)
+	};
+	Class cls;
+	CLARA_INSTRUCTION insn = INSN_INVALID;
+
+	PeepholeMatch(CLARA_INSTRUCTION in) : cls(INSN), insn(in) { }
+	PeepholeMatch(Class c) : cls(c) { }
+
+	inline bool Matches(const CodeInstruction& ci) const {
+		switch (cls) {
+		case INSN: return ci.insn == insn;
+		case CONST: return ci.insn == INSN_PUSHN || (ci.insn >= INSN_PUSHB && ci.insn <= INSN_PUSHF) || ci.insn == INSN_PUSHS;
+		case INT: return ci.insn >= INSN_PUSHB && ci.insn <= INSN_PUSHD;
+		}
+		return false;
+	}
+	// Name in reports - the instruction's own name from g_Instructions, or the class
+	inline const char* GetName() const {
+		switch (cls) {
+		case INSN: return g_Instructions[insn].name;
+		case CONST: return "push";
+		case INT: return "push int";
+		}
+		return "";
+	}
+};
+
+// Rewrites a sequence of instructions matching 'pattern' into no more than as many instructions
+// 'rewrite' gets the matched instructions and returns false if their operands don't fit the rule
+struct PeepholeRule {
+	CLARA_PEEPHOLE group;				// the option bit which enables the rule
+	std::vector<PeepholeMatch> pattern;
+	bool(*rewrite)(const CodeInstruction* in, std::vector<CodeInstruction>& out);
+};
+
+extern const std::vector<PeepholeRule> g_PeepholeRules;
+
+// Optimizes a compiled instruction stream in place
+//
+// Branch operands are code offsets, so rewrites never span a branch target (a rule may still start at one) or change
+// the instruction following an 'if', and every branch is moved to the new offset of its target afterwards. Code
+// with branches which can't be followed (computed jmp/call, or targets inside an instruction) is left alone. Switch
+// tables are never matched by a rule, so they stay together behind their switch.
+class Optimizer {
+	Context& m_context;
+	std::vector<CodeInstruction>& m_code;
+
+	std::vector<uint32_t> m_offsets;		// original offset of each instruction, and the end of the code
+	std::vector<bool> m_targets;			// whether each instruction is a branch target
+	std::vector<bool> m_removed;
+
+	static constexpr size_t NONE = SIZE_MAX;	// no instruction, as Prev() gives before the first one
+
+	// Index of the instruction a branch goes to, or NONE if it isn't the start of one
+	size_t FindTarget(uint32_t offset) const {
+		auto it = std::lower_bound(m_offsets.begin(), m_offsets.end(), offset);
+		return it != m_offsets.end() && *it == offset ? it - m_offsets.begin() : NONE;
+	}
+	size_t Next(size_t i) const {
+		while (++i < m_code.size() && m_removed[i]);
+		return i;
+	}
+	size_t Prev(size_t i) const {
+		while (i-- > 0 && m_removed[i]);
+		return i;
+	}
+
+	// Finds the offsets of the instructions and the branch targets - returns false if the branches can't be followed
+	bool Map() {
+		m_offsets.clear();
+		uint32_t offset = 0;
+		for (auto& ci : m_code) {
+			switch (ci.insn) {
+			case INSN_JMP: case INSN_CALL:
+				return false;
+			default: break;
+			}
+			m_offsets.push_back(offset);
+			offset += static_cast<uint32_t>(GetInstructionSize(ci.insn));
+		}
+		m_offsets.push_back(offset);
+
+		m_targets.assign(m_offsets.size(), false);
+		for (auto& ci : m_code) {
+			if (!ci.IsBranch()) continue;
+			auto target = FindTarget(ci.Target());
+			if (target == NONE) return false;
+			m_targets[target] = true;
+		}
+		return true;
+	}
+
+	// Tries a rule on the instructions from 'i' - returns true if they were rewritten
+	bool Apply(const PeepholeRule& rule, size_t i, std::vector<CodeInstruction>& in, std::vector<CodeInstruction>& out) {
+		// the instruction after an 'if' has to stay a single instruction
+		auto prev = Prev(i);
+		if (prev != NONE && m_code[prev].insn == INSN_IF)
+			return false;
+
+		std::vector<size_t> slots;
+		in.clear();
+		for (size_t j = i; slots.size() < rule.pattern.size(); j = Next(j)) {
+			if (j == m_code.size() || !rule.pattern[slots.size()].Matches(m_code[j]))
+				return false;
+			slots.push_back(j);
+			in.push_back(m_code[j]);
+		}
+		// a branch into the middle of the sequence - removed instructions count as their successor
+		for (size_t j = i + 1; j <= slots.back(); ++j) {
+			if (m_targets[j]) return false;
+		}
+
+		out.clear();
+		if (!rule.rewrite(in.data(), out))
+			return false;
+		assert(out.size() <= slots.size());
+
+		for (size_t j = 0; j < slots.size(); ++j) {
+			if (j < out.size()) m_code[slots[j]] = out[j];
+			else m_removed[slots[j]] = true;
+		}
+		return true;
+	}
+
+	// Moves the branches to the new offsets of their targets and drops the removed instructions
+	void Relocate() {
+		std::vector<uint32_t> offsets(m_offsets.size());
+		uint32_t offset = 0;
+		for (size_t i = 0; i < m_code.size(); ++i) {
+			offsets[i] = offset;
+			if (!m_removed[i]) offset += static_cast<uint32_t>(GetInstructionSize(m_code[i].insn));
+		}
+		offsets.back() = offset;
+
+		size_t n = 0;
+		for (size_t i = 0; i < m_code.size(); ++i) {
+			if (m_removed[i]) continue;
+			auto& ci = m_code[n++] = m_code[i];
+			if (ci.IsBranch()) ci.Target() = offsets[FindTarget(ci.Target())];
+		}
+		m_code.resize(n);
+	}
+
+	// Replaces the instructions in [start, end) with 'out' if it's shorter - returns true if it was
+	bool Replace(size_t start, size_t end, const std::vector<CodeInstruction>& out) {
+		size_t count = 0;
+		for (size_t j = start; j < end; ++j) count += !m_removed[j];
+		if (out.size() >= count) return false;
+
+		size_t n = 0;
+		for (size_t j = start; j < end; ++j) {
+			if (m_removed[j]) continue;
+			if (n < out.size()) m_code[j] = out[n++];
+			else m_removed[j] = true;
+		}
+		return true;
+	}
+
+public:
+	Optimizer(Context& context, std::vector<CodeInstruction>& code) : m_context(context), m_code(code) { }
+
+	// Folds instructions which only work on constants into pushes of their results, and branches on constant
+	// conditions into jmpa (or nothing) - the stack is tracked from the last instruction which wasn't folded, or the
+	// last branch target, as the values below that aren't known
+	void Fold() {
+		if (!Map()) {
+			m_context.Output("Fold: skipped, the code has branches which can't be followed");
+			return;
+		}
+
+		size_t count = m_code.size();
+		size_t numBranches = 0;
+		m_removed.assign(m_code.size(), false);
+
+		std::vector<Constant> stack;
+		std::vector<CodeInstruction> out;
+		size_t start = 0;
+		size_t skip = NONE;			// instruction skipped by a folded 'if'
+		bool isolate = false;		// the next instruction follows an 'if' which wasn't folded, so it has to stay as it is
+
+		// ends the sequence before 'end' and replaces it with pushes of the values it leaves
+		auto flush = [&](size_t end, const CodeInstruction* jump = nullptr) {
+			out.clear();
+			for (auto& c : stack) out.push_back(c.ToPush());
+			if (jump) out.push_back(*jump);
+			Replace(start, end, out);
+			stack.clear();
+			start = end;
+		};
+
+		for (size_t i = 0; i < m_code.size(); ++i) {
+			if (m_removed[i] || i == skip) continue;
+			auto& ci = m_code[i];
+
+			if (m_targets[i] || isolate) flush(i);
+			if (isolate) {
+				isolate = false;
+				start = i + 1;
+				continue;
+			}
+			if (Evaluate(ci, stack)) continue;
+
+			if (!stack.empty() && (ci.insn == INSN_JT || ci.insn == INSN_JNT)) {
+				bool taken = stack.back().IsTrue() == (ci.insn == INSN_JT);
+				stack.pop_back();
+				++numBranches;
+				if (taken) {
+					CodeInstruction jump(INSN_JMPA, ci.operands[0]);
+					flush(i + 1, &jump);
+				}
+				continue;
+			}
+			if (!stack.empty() && ci.insn == INSN_IF) {
+				// a skipped branch target would still have to be there
+				auto next = Next(i);
+				if (stack.back().IsTrue() || next == m_code.size() || !m_targets[next]) {
+					if (!stack.back().IsTrue()) skip = next;
+					stack.pop_back();
+					++numBranches;
+					continue;
+				}
+			}
+
+			flush(i);
+			start = i + 1;
+			isolate = ci.insn == INSN_IF;
+		}
+		flush(m_code.size());
+
+		Relocate();
+		m_context.Output("Fold: " + std::to_string(numBranches) + " branches, removed "
+			+ std::to_string(count - m_code.size()) + " instructions");
+	}
+
+	// Gives each branch the shortest form which reaches its target - the sizes start at the shortest and only grow,
+	// so this settles once none have to. Leaves the branches absolute if they can't all be followed.
+	void Relax() {
+		if (!Map()) return;
+
+		std::vector<size_t> targets(m_code.size());
+		std::vector<uint8_t> sizes(m_code.size());
+		for (size_t i = 0; i < m_code.size(); ++i) {
+			auto& ci = m_code[i];
+			sizes[i] = static_cast<uint8_t>(GetInstructionSize(ci.insn));
+			if (!ci.IsBranch()) continue;
+			targets[i] = FindTarget(ci.Target());
+			if (GetShortBranch(ci.insn, 1) != INSN_INVALID) sizes[i] = 2;
+		}
+
+		std::vector<uint32_t> offsets(m_code.size() + 1);
+		auto disp = [&](size_t i) {
+			return static_cast<int64_t>(offsets[targets[i]]) - static_cast<int64_t>(offsets[i] + sizes[i]);
+		};
+		for (bool changed = true; changed; ) {
+			changed = false;
+			for (size_t i = 0; i < m_code.size(); ++i)
+				offsets[i + 1] = offsets[i] + sizes[i];
+
+			for (size_t i = 0; i < m_code.size(); ++i) {
+				if (!m_code[i].IsBranch() || sizes[i] > 3) continue;
+				auto d = disp(i);
+				uint8_t size = d >= INT8_MIN && d <= INT8_MAX ? 2 : d >= INT16_MIN && d <= INT16_MAX ? 3 : 5;
+				if (size > sizes[i]) {
+					sizes[i] = size;
+					changed = true;
+				}
+			}
+		}
+
+		for (size_t i = 0; i < m_code.size(); ++i) {
+			auto& ci = m_code[i];
+			if (!ci.IsBranch()) continue;
+			if (sizes[i] < 5) {
+				ci.insn = GetShortBranch(ci.insn, sizes[i] - 1);
+				ci.operands[0] = static_cast<uint32_t>(disp(i));
+			}
+			else ci.Target() = offsets[targets[i]];
+		}
+	}
+
+	// Applies the peephole rules of the groups in 'mask' until none match, then reports how often each was used
+	void Peephole(int mask) {
+		if (!Map()) {
+			m_context.Output("Peephole: skipped, the code has branches which can't be followed");
+			return;
+		}
+
+		std::vector<size_t> hits(g_PeepholeRules.size());
+		std::vector<CodeInstruction> in, out;
+		size_t maxLength = 0;
+		for (auto& rule : g_PeepholeRules) maxLength = std::max(maxLength, rule.pattern.size());
+		m_removed.assign(m_code.size(), false);
+
+		for (size_t i = 0; i < m_code.size(); ) {
+			bool applied = false;
+			for (size_t r = 0; r < g_PeepholeRules.size() && !applied; ++r) {
+				auto& rule = g_PeepholeRules[r];
+				if ((rule.group & mask) && Apply(rule, i, in, out)) {
+					++hits[r];
+					applied = true;
+				}
+			}
+			if (!applied) {
+				i = Next(i);
+				continue;
+			}
+
+			// the result may complete a pattern with the instructions before it
+			if (m_removed[i]) i = Next(i);
+			for (size_t back = 1; back < maxLength; ++back) {
+				auto prev = Prev(i);
+				if (prev == NONE) break;
+				i = prev;
+			}
+		}
+
+		size_t size = m_offsets.back(), count = m_code.size();
+		Relocate();
+
+		for (size_t r = 0; r < g_PeepholeRules.size(); ++r) {
+			if (!hits[r]) continue;
+			std::string msg = "Peephole:";
+			for (auto& match : g_PeepholeRules[r].pattern)
+				msg += std::string(" ") + match.GetName();
+			m_context.Output(msg + " x" + std::to_string(hits[r]));
+		}
+		size_t newSize = 0;
+		for (auto& ci : m_code) newSize += GetInstructionSize(ci.insn);
+		m_context.Output("Peephole: removed " + std::to_string(count - m_code.size()) + " instructions, "
+			+ std::to_string(size - newSize) + " bytes");
+	}
+};
+
+CLARA_NAMESPACE_END
@@ -1,128 +1,248 @@
 #pragma once
 #include <assert.h>
 #include <vector>
-#include <algorithm>
-#include <cctype>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include "Assembly.h"
+#include "Context.h"
+#include "GlobalTable.h"
+#include "Lexer.h"
+#include "StringPool.h"
 #include "Types.h"
 
 CLARA_NAMESPACE_BEGIN
 
+// Names of the labels in a script, numbered in the order they're first seen - case-insensitive like everything else
+class LabelTable {
+	std::unordered_map<std::string, uint32_t> m_ids;
+	std::vector<std::string> m_names;
+
+public:
+	uint32_t GetID(std::string_view name) {
+		std::string key(name);
+		for (auto& c : key) c = ToLower(c);
+		auto it = m_ids.emplace(key, static_cast<uint32_t>(m_names.size())).first;
+		if (it->second == m_names.size()) m_names.emplace_back(name);
+		return it->second;
+	}
+	inline const std::string& GetName(uint32_t id) const { return m_names[id]; }
+	inline size_t Size() const { return m_names.size(); }
+};
+
 class Parser {
 	bool m_acceptRepeatInstr = false;
 
 	std::vector<Operand> m_operands;
-	std::vector<std::vector<Operand>>& m_lines;
+	std::vector<Line>& m_lines;
+	OperandArena& m_arena;
+	LabelTable* m_labels = nullptr;		// labels aren't recognised without one
+	StringPool* m_strings = nullptr;	// nor strings without a pool
+	GlobalTable* m_globals = nullptr;	// nor globals without a table
+	Context* m_context = nullptr;		// malformed operands are only reported with a context
 
-public:
-	Parser(std::vector<std::vector<Operand>>& lines) : m_lines(lines) { }
-	Parser(std::string line, std::vector<std::vector<Operand>>& lines) : m_lines(lines) {
-		Parse(line);
+	void PushLine() {
+		m_lines.emplace_back(m_arena.Copy(m_operands.data(), m_operands.size()), m_operands.size());
+		m_operands.clear();
+	}
+	void EndLine() {
+		if (!m_operands.empty())
+			PushLine();
+		m_acceptRepeatInstr = false;
 	}
+	// After a comma, operands without a mnemonic repeat the previous instruction
+	void RepeatInstruction(bool noComma) {
+		if (m_acceptRepeatInstr & !noComma) {
+			assert(!m_lines.empty());
 
-	void Parse(std::string line) {
-		m_operands.clear();
-		line = line.substr(line.find_first_not_of(" \t"), line.find_first_of(';'));
+			auto tmp = m_lines.back().front();
+			m_operands.emplace_back(tmp);
+			m_acceptRepeatInstr = false;
+		}
+	}
+	// Whether the operands being parsed are for a branch, so identifiers in them are labels
+	bool IsBranch() const {
+		const Operand* ins = nullptr;
+		if (!m_operands.empty()) ins = &m_operands.front();
+		else if (m_acceptRepeatInstr && !m_lines.empty()) ins = &m_lines.back().front();
+		if (!ins || ins->GetType() != OP_INSTRUCTION) return false;
 
-		// remove duplicate whitespace
-		auto end = std::unique(line.begin(), line.end(), [](char l, char r) { return (l == ' ' || l == '\t') && (r == ' ' || r == '\t'); });
-		line.erase(end, line.end());
-		if (line.empty()) return;
+		switch (ins->GetMnemonic()) {
+		case CLARA_JT: case CLARA_JNT: case CLARA_JMP: case CLARA_CALL: case CLARA_SWITCH: case CLARA_RSWITCH:
+			return true;
+		default: break;
+		}
+		return false;
+	}
 
-		std::transform(line.begin(), line.end(), line.begin(), [](int c) { return std::tolower(c); });
+	// '.strings name "text" ...' declares names for strings, for use by the lines after it
+	// Takes the rest of the line - returns false once the end has been reached
+	bool ParseStrings(Lexer& lexer) {
+		for (auto tok = lexer.Next(); ; tok = lexer.Next()) {
+			if (tok.type == TOKEN_NEWLINE || tok.type == TOKEN_END) {
+				EndLine();
+				return tok.type == TOKEN_NEWLINE;
+			}
+			auto text = lexer.Next();
+			if (tok.type == TOKEN_IDENTIFIER && text.type == TOKEN_STRING) {
+				m_strings->Declare(tok.text, text.text);
+				continue;
+			}
 
-		for (size_t i = line.find_first_not_of(" \t"), j; (j = line.find_first_of(" \t,", i)) != line.npos || i != line.npos; i = line.find_first_not_of(" \t", j)) {
-			if (line[i] == '.')
-				break;
-			if (line[i] == ',') {
-				auto op = ParseOperand(",");
-				if (op) m_operands.emplace_back(op);
-				++j;
+			m_strings->Reject(".strings");
+			if (text.type == TOKEN_NEWLINE || text.type == TOKEN_END) {
+				EndLine();
+				return text.type == TOKEN_NEWLINE;
 			}
+			lexer.SkipLine();
+		}
+	}
+	// '.globals name ...' declares globals, for use by the lines after it
+	// Takes the rest of the line - returns false once the end has been reached
+	bool ParseGlobals(Lexer& lexer) {
+		for (auto tok = lexer.Next(); ; tok = lexer.Next()) {
+			if (tok.type == TOKEN_NEWLINE || tok.type == TOKEN_END) {
+				EndLine();
+				return tok.type == TOKEN_NEWLINE;
+			}
+			if (tok.type == TOKEN_IDENTIFIER) m_globals->Declare(tok.text);
 			else {
-				auto ln = line.substr(i, j - i);
-				auto op = ParseOperand(line.substr(i, j - i));
-				if (op) m_operands.emplace_back(op);
+				m_globals->Reject(".globals");
+				lexer.SkipLine();
 			}
 		}
-
-		if (!m_operands.empty()) {
-			m_lines.emplace_back(m_operands);
-			m_operands.clear();
-		}
 	}
 
-	Operand ParseOperand(std::string op, bool noComma = false) {
-		Operand operand;
+public:
+	Parser(OperandArena& arena, std::vector<Line>& lines, LabelTable* labels = nullptr, StringPool* strings = nullptr, GlobalTable* globals = nullptr, Context* context = nullptr) :
+		m_lines(lines), m_arena(arena), m_labels(labels), m_strings(strings), m_globals(globals), m_context(context) { }
+	Parser(std::string_view code, OperandArena& arena, std::vector<Line>& lines) : m_lines(lines), m_arena(arena) {
+		Parse(code);
+	}
 
-		if (!op.empty()) {
-			if (std::isdigit(op[0]) || op[0] == '-') {
-				if (m_acceptRepeatInstr & !noComma) {
-					assert(!m_lines.empty());
+	// Parses any number of lines of code - 'base' is the offset of 'code' within the source
+	void Parse(std::string_view code, size_t base = 0) {
+		Lexer lexer(code, base);
+		while (ParseLine(lexer));
+	}
+	// Parses the next line of source from the lexer - returns false once the end has been reached
+	bool ParseLine(Lexer& lexer) {
+		for (;;) {
+			auto tok = lexer.Next();
 
-					auto tmp = m_lines.back().front();
-					m_operands.emplace_back(tmp);
+			switch (tok.type) {
+			case TOKEN_END:
+				EndLine();
+				return false;
+			case TOKEN_NEWLINE:
+				EndLine();
+				return true;
+			case TOKEN_DIRECTIVE:
+				if (m_strings && EqualsNoCase(tok.text, ".strings"))
+					return ParseStrings(lexer);
+				if (m_globals && EqualsNoCase(tok.text, ".globals"))
+					return ParseGlobals(lexer);
+				lexer.SkipLine();
+				break;
+			case TOKEN_LABEL:
+				// labels get a line of their own, and are defined at the instruction which follows
+				if (m_labels) {
+					if (!m_operands.empty()) PushLine();
+					m_operands.emplace_back(Operand::Label(OP_LABEL, m_labels->GetID(tok.text)));
+					PushLine();
 					m_acceptRepeatInstr = false;
 				}
+				break;
+			default:
+				{
+					auto op = ParseOperand(tok);
+					if (op) m_operands.emplace_back(op);
+				}
+				break;
+			}
+		}
+	}
+
+	Operand ParseOperand(std::string_view op, bool noComma = false) {
+		Lexer lexer(op);
+		return ParseOperand(lexer.Next(), noComma);
+	}
+	Operand ParseOperand(const Token& tok, bool noComma = false) {
+		Operand operand;
+
+		switch (tok.type) {
+		case TOKEN_NUMBER:
+			{
+				RepeatInstruction(noComma);
 
 				assert(!m_operands.empty() || noComma);
 
-				bool b = true;
-				if (b) {
-					try {
-						auto v = std::stol(op, 0, 0);
-						size_t s = GetIntNumBytes(v);
-						if (s <= 1) operand = std::make_shared<Imm<int8_t>>(v);
-						else if (s <= 2) operand = std::make_shared<Imm<int16_t>>(v);
-						else operand = std::make_shared<Imm<int32_t>>(v);
-						b = false;
-					}
-					catch (...) { BREAK(); }
+				auto num = ClassifyNumber(tok.text);
+				switch (num.kind) {
+				case NUMBER_INT:
+					if (num.size <= 1) operand = Operand::Imm<int8_t>(num.nValue);
+					else if (num.size <= 2) operand = Operand::Imm<int16_t>(num.nValue);
+					else operand = Operand::Imm<int32_t>(num.nValue);
+					break;
+				case NUMBER_UINT:
+					if (num.size <= 1) operand = Operand::Imm<uint8_t>(num.dwValue);
+					else if (num.size <= 2) operand = Operand::Imm<uint16_t>(num.dwValue);
+					else operand = Operand::Imm<uint32_t>(num.dwValue);
+					break;
+				case NUMBER_FLOAT:
+					operand = Operand::Imm<float>(num.fValue);
+					break;
+				default:
+					if (m_context) m_context->SendError(CLARA_ERROR_INVALID_NUMBER, std::string(tok.text));
+					break;
 				}
-				if (b) {
-					try {
-						auto v = std::stoul(op, 0, 0);
-						operand = std::make_shared<Imm<uint32_t>>(v);
-						size_t s = GetUIntNumBytes(v);
-						if (s <= 1) operand = std::make_shared<Imm<uint8_t>>(v);
-						else if (s <= 2) operand = std::make_shared<Imm<uint16_t>>(v);
-						else operand = std::make_shared<Imm<uint32_t>>(v);
-						b = false;
-					}
-					catch (...) { BREAK(); }
-				}
-				if (b) {
-					try {
-						auto v = std::stof(op);
-						operand = std::make_shared<Imm<float>>(v);
-						b = false;
-					}
-					catch (...) { BREAK(); }
-				}
-				assert(!b);
 			}
-			else if (op == ",") {
-				if (m_operands.size()) {
-					m_lines.emplace_back(m_operands);
-					m_operands.clear();
-					m_acceptRepeatInstr = true;
-				}
+			break;
+		case TOKEN_STRING:
+			if (m_strings) {
+				RepeatInstruction(noComma);
+				operand = Operand::Str(m_strings->Intern(tok.text));
 			}
-			else {
+			break;
+		case TOKEN_COMMA:
+			if (m_operands.size()) {
+				PushLine();
+				m_acceptRepeatInstr = true;
+			}
+			break;
+		case TOKEN_IDENTIFIER:
+			{
 				// identifier operand, check for mnemonic
-				auto it = g_Mnemonics.find(op);
-				if (it != g_Mnemonics.end()) {
+				auto mn = FindMnemonic(tok.text);
+				if (mn != CLARA_BAD_MNEMONIC) {
 					m_acceptRepeatInstr = false;
-					operand = std::make_shared<Ins>(it->second);
+					operand = Operand::Ins(mn);
+				}
+				else if (m_labels && IsBranch()) {
+					RepeatInstruction(noComma);
+					operand = Operand::Label(OP_REFERENCE, m_labels->GetID(tok.text));
+				}
+				else if (m_strings && m_strings->Find(tok.text) != StringPool::NONE) {
+					RepeatInstruction(noComma);
+					operand = Operand::Str(m_strings->Find(tok.text));
+				}
+				else if (m_globals && m_globals->Find(tok.text) != GlobalTable::NONE) {
+					RepeatInstruction(noComma);
+					auto id = m_globals->Find(tok.text);
+					m_globals->Reference(id);
+					operand = Operand::Glob(id);
 				}
 				else {
 					// none found, check for variable
 					BREAK();
 				}
 			}
+			break;
+		default:
+			break;
 		}
 		return operand;
 	}
 };
 
-CLARA_NAMESPACE_END
\ No newline at end of file
+CLARA_NAMESPACE_END
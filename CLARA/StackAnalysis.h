@@ -0,0 +1,215 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "CLARA.h"
+#include "Assembly.h"
+#include "Optimizer.h"
+
+CLARA_NAMESPACE_BEGIN
+
+enum STACK_RESULT {
+	STACK_OK,
+	STACK_UNBALANCED,			// an instruction is reached with different depths, or a function returns both with and without a result
+	STACK_UNDERFLOW,			// an instruction pops more values than there are
+	STACK_RECURSIVE,			// a function calls itself, so the depth has no bound
+	STACK_UNFOLLOWABLE,			// computed jmp/call, or a branch which doesn't land on an instruction
+};
+
+// Works out how deep the stack gets by following every path through each function with the effects in g_StackEffects
+//
+// Depths are counted from the base of the function's frame, and can go below it as functions may work on their
+// caller's values. A call adds the callee's lowest and deepest points to the depth at the call and leaves its result,
+// if it returns one (anything above its locals, as the VM has it), so only the top level has to stay above 0. The VM
+// also limits the number of frames to the size of the stack, so the size covers the deepest chain of calls as well.
+class StackAnalysis {
+	static constexpr size_t NONE = SIZE_MAX;	// no instruction, as Find() gives for an offset which doesn't start one
+
+	struct State {
+		int32_t depth;
+		int32_t locals;			// depth of the end of the locals reserved by 'enter'
+		inline bool operator==(const State& r) const { return depth == r.depth && locals == r.locals; }
+	};
+	struct Function {
+		bool done = false;
+		bool returns = false;		// whether any path returns
+		bool result = false;		// whether it returns a value
+		size_t mixed = NONE;		// a return which disagrees with another on the result, which only matters if it's called
+		int32_t minDepth = 0;
+		int32_t maxDepth = 0;
+		uint32_t maxFrames = 1;
+		size_t lowest = 0;			// instruction which takes it to its lowest point
+	};
+
+	const std::vector<CodeInstruction>& m_code;
+	std::vector<uint32_t> m_offsets;			// offset of each instruction, and the end of the code
+	std::unordered_map<size_t, Function> m_functions;
+
+	STACK_RESULT m_result = STACK_OK;
+	uint32_t m_offset = 0;
+
+	bool Fail(STACK_RESULT result, size_t i) {
+		m_result = result;
+		m_offset = m_offsets[i];
+		return false;
+	}
+	// Index of the instruction at a branch target, or NONE if there isn't one - the end of the code is the index past
+	// the last instruction, which returns
+	size_t Find(uint32_t offset) const {
+		auto it = std::lower_bound(m_offsets.begin(), m_offsets.end(), offset);
+		return it != m_offsets.end() && *it == offset ? it - m_offsets.begin() : NONE;
+	}
+	// Where a branch goes - short branches are relative to the next instruction
+	size_t GetTarget(size_t i) const {
+		auto& ci = m_code[i];
+		switch (ci.insn) {
+		case INSN_JTB: case INSN_JNTB: case INSN_JMPB:
+			return Find(m_offsets[i + 1] + static_cast<uint32_t>(static_cast<int8_t>(ci.operands[0])));
+		case INSN_JTW: case INSN_JNTW: case INSN_JMPW:
+			return Find(m_offsets[i + 1] + static_cast<uint32_t>(static_cast<int16_t>(ci.operands[0])));
+		default: break;
+		}
+		return Find(ci.Target());
+	}
+
+	// Follows the function entered at 'entry' - returns false once the analysis has failed
+	bool Analyze(size_t entry) {
+		// added before it's done, so calls back into it are caught
+		auto& function = m_functions[entry];
+		std::unordered_map<size_t, State> states;
+		std::vector<size_t> work;
+		int32_t minDepth = 0, maxDepth = 0;
+		uint32_t maxFrames = 1;
+		size_t lowest = entry;
+		bool returns = false, result = false;
+		size_t mixed = NONE;
+
+		auto reach = [&](size_t i, const State& state) {
+			if (i == NONE) return false;
+			auto it = states.emplace(i, state);
+			if (it.second) work.push_back(i);
+			else if (!(it.first->second == state)) return Fail(STACK_UNBALANCED, i);
+			return true;
+		};
+		reach(entry, {0, 0});
+
+		while (!work.empty()) {
+			size_t i = work.back();
+			work.pop_back();
+			auto state = states[i];
+
+			// running off the end of the code returns
+			CLARA_INSTRUCTION insn = i < m_code.size() ? m_code[i].insn : INSN_RET;
+			if (insn == INSN_RET) {
+				bool value = state.depth > state.locals;
+				if (returns && value != result) mixed = i;
+				returns = true;
+				result = value;
+				continue;
+			}
+
+			auto& ci = m_code[i];
+			auto& effect = g_StackEffects[insn];
+			state.depth -= static_cast<int32_t>(effect.GetPops(ci.operands[0]));
+			if (state.depth < minDepth) {
+				minDepth = state.depth;
+				lowest = i;
+			}
+			state.depth += static_cast<int32_t>(effect.GetPushes(ci.operands[0]));
+			maxDepth = std::max(maxDepth, state.depth);
+			if (insn == INSN_ENTER) state.locals = state.depth;
+
+			bool ok = true;
+			switch (insn) {
+			case INSN_THROW: case INSN_CASE:
+				break;
+			case INSN_JMP: case INSN_CALL:
+				return Fail(STACK_UNFOLLOWABLE, i);
+			case INSN_JT: case INSN_JNT: case INSN_JTB: case INSN_JTW: case INSN_JNTB: case INSN_JNTW:
+				ok = reach(i + 1, state) && reach(GetTarget(i), state);
+				break;
+			case INSN_JMPA: case INSN_JMPB: case INSN_JMPW:
+				ok = reach(GetTarget(i), state);
+				break;
+			case INSN_IF:
+				ok = reach(i + 1, state) && reach(i + 1 < m_code.size() ? i + 2 : i + 1, state);
+				break;
+			case INSN_SWITCH: case INSN_RSWITCH:
+			{
+				size_t count = static_cast<uint16_t>(ci.operands[0]);
+				ok = reach(GetTarget(i), state);
+				for (size_t j = i + 1; ok && j <= i + count; ++j) {
+					if (j >= m_code.size() || m_code[j].insn != INSN_CASE) return Fail(STACK_UNFOLLOWABLE, i);
+					ok = reach(GetTarget(j), state);
+				}
+				break;
+			}
+			case INSN_CALLA:
+			{
+				size_t callee = GetTarget(i);
+				if (callee == NONE) return Fail(STACK_UNFOLLOWABLE, i);
+				auto it = m_functions.find(callee);
+				if (it != m_functions.end() && !it->second.done) return Fail(STACK_RECURSIVE, i);
+				if (it == m_functions.end() && !Analyze(callee)) return false;
+
+				auto& called = m_functions[callee];
+				if (called.mixed != NONE) return Fail(STACK_UNBALANCED, called.mixed);
+				if (state.depth + called.minDepth < minDepth) {
+					minDepth = state.depth + called.minDepth;
+					lowest = called.lowest;
+				}
+				maxDepth = std::max(maxDepth, state.depth + called.maxDepth);
+				maxFrames = std::max(maxFrames, called.maxFrames + 1);
+				// a function which never returns doesn't come back here
+				if (called.returns) {
+					state.depth += called.result;
+					maxDepth = std::max(maxDepth, state.depth);
+					ok = reach(i + 1, state);
+				}
+				break;
+			}
+			default:
+				ok = reach(i + 1, state);
+				break;
+			}
+			if (!ok) return m_result != STACK_OK ? false : Fail(STACK_UNFOLLOWABLE, i);
+		}
+
+		function.done = true;
+		function.returns = returns;
+		function.result = result;
+		function.mixed = mixed;
+		function.minDepth = minDepth;
+		function.maxDepth = maxDepth;
+		function.lowest = lowest;
+		function.maxFrames = maxFrames;
+		return true;
+	}
+
+public:
+	StackAnalysis(const std::vector<CodeInstruction>& code) : m_code(code) {
+		m_offsets.reserve(code.size() + 1);
+		uint32_t offset = 0;
+		for (auto& ci : code) {
+			m_offsets.push_back(offset);
+			offset += static_cast<uint32_t>(GetInstructionSize(ci.insn));
+		}
+		m_offsets.push_back(offset);
+
+		if (!code.empty() && Analyze(0) && m_functions[0].minDepth < 0)
+			Fail(STACK_UNDERFLOW, m_functions[0].lowest);
+	}
+
+	inline STACK_RESULT GetResult() const { return m_result; }
+	// Offset of the instruction the analysis failed at
+	inline uint32_t GetOffset() const { return m_offset; }
+	// Values the stack needs room for - 0 if the analysis failed or nothing is ever pushed
+	uint32_t GetStackSize() const {
+		if (m_result != STACK_OK || m_code.empty()) return 0;
+		auto& top = m_functions.at(0);
+		return std::max(static_cast<uint32_t>(top.maxDepth), top.maxFrames);
+	}
+};
+
+CLARA_NAMESPACE_END
@@ -0,0 +1,102 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <numeric>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "CLARA.h"
+#include "BytecodeWriter.h"
+#include "Context.h"
+#include "File.h"
+#include "Lexer.h"
+
+CLARA_NAMESPACE_BEGIN
+
+// The strings of a script - '.strings' declarations and literals in the code share one table, with each text stored
+// once however often it's used, so equal strings always have the same index
+class StringPool {
+	Context& m_context;
+	std::vector<std::string> m_texts;
+	std::unordered_map<std::string, uint32_t> m_indexes;
+	std::unordered_map<std::string, uint32_t> m_names;		// declared names, lower case
+
+	static std::string Key(std::string_view name) {
+		std::string key(name);
+		for (auto& c : key) c = ToLower(c);
+		return key;
+	}
+
+public:
+	enum : uint32_t { NONE = UINT32_MAX };
+
+	StringPool(Context& context) : m_context(context) { }
+
+	// Index of a text, added if it's new
+	uint32_t Intern(std::string_view text) {
+		auto it = m_indexes.emplace(text, static_cast<uint32_t>(m_texts.size())).first;
+		if (it->second == m_texts.size()) m_texts.emplace_back(text);
+		return it->second;
+	}
+	// Declares a name for a text - names are case-insensitive like everything else
+	void Declare(std::string_view name, std::string_view text) {
+		if (!m_names.emplace(Key(name), Intern(text)).second)
+			m_context.SendError(CLARA_ERROR_DUPLICATE_STRING, std::string(name));
+	}
+	// Reports a malformed declaration
+	inline void Reject(const char* directive) {
+		m_context.SendError(CLARA_ERROR_INVALID_DIRECTIVE, directive);
+	}
+	// Index of the text with a declared name, or NONE
+	uint32_t Find(std::string_view name) const {
+		auto it = m_names.find(Key(name));
+		return it != m_names.end() ? it->second : NONE;
+	}
+	inline size_t Size() const { return m_texts.size(); }
+
+	// Writes the strings segment - returns its size, 0 if there are no strings
+	//
+	// Texts which end another are stored as the tail of it: sorted by their reversed text, a text is the suffix of
+	// another exactly when it's the suffix of the one after it, so the longest of each run is stored for all of them
+	size_t Write(BytecodeWriter& out) const {
+		if (m_texts.empty()) return 0;
+
+		std::vector<uint32_t> order(m_texts.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [this](uint32_t l, uint32_t r) {
+			auto& a = m_texts[l];
+			auto& b = m_texts[r];
+			return std::lexicographical_compare(a.rbegin(), a.rend(), b.rbegin(), b.rend());
+		});
+
+		std::vector<uint32_t> offsets(m_texts.size());
+		std::string data;
+		for (size_t i = order.size(); i--; ) {
+			auto& text = m_texts[order[i]];
+			if (i + 1 < order.size()) {
+				auto& next = m_texts[order[i + 1]];
+				if (next.size() >= text.size() && !next.compare(next.size() - text.size(), text.size(), text)) {
+					offsets[order[i]] = offsets[order[i + 1]] + static_cast<uint32_t>(next.size() - text.size());
+					continue;
+				}
+			}
+			offsets[order[i]] = static_cast<uint32_t>(data.size());
+			data.append(text);
+			data.push_back('\0');
+		}
+
+		size_t start = out.Size();
+		out.Put32(static_cast<uint32_t>(m_texts.size()));
+		for (size_t i = 0; i < m_texts.size(); ++i) {
+			auto& text = m_texts[i];
+			out.Put32(offsets[i]);
+			out.Put32(static_cast<uint32_t>(text.size()));
+			out.Put32(HashString(text.data(), text.size()));
+		}
+		out.Put(data.data(), data.size());
+		return out.Size() - start;
+	}
+};
+
+CLARA_NAMESPACE_END
@@ -12,9 +12,23 @@ enum ImmediateType {
 	ImmNone, Imm8, Imm16, Imm32,
 	Local8, Local16, Local32,
 	Global16, Global32,
-	String32,
+	String32, Float32,
 };
 
+// Size in bytes of an immediate as it is encoded in the bytecode
+inline size_t GetImmSize(ImmediateType type) {
+	switch (type) {
+	case Imm8: case Local8:
+		return 1;
+	case Imm16: case Local16: case Global16:
+		return 2;
+	case Imm32: case Local32: case Global32: case String32: case Float32:
+		return 4;
+	default: break;
+	}
+	return 0;
+}
+
 class ValueType {
 	BasicType m_type;
 
@@ -38,6 +52,8 @@ class ImmValue : public ValueType {
 			return Global;
 		case String32:
 			return String;
+		case Float32:
+			return Float;
 		}
 		return Null;
 	}
@@ -8,4 +8,5 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
\ No newline at end of file